@@ -1,14 +1,16 @@
 -- lua script
 require("luapb")
 local luapb = pb.new("net.proto")
+local fixture = pb.new("test.proto")
 
 function bin2hex(s)
     s = string.gsub(s,"(.)",function (x) return string.format("%02X ",string.byte(x)) end)
     return s
 end
 
-function pb_encode_test(num) 
-    local message = {
+-- the tb_Person every test encodes, a fresh table per call as some tests change it
+function person()
+    return {
         number = "13615632545",
         email = "13615632545@163.com",
         age = 28,
@@ -25,6 +27,19 @@ function pb_encode_test(num)
             }
         }
     }
+end
+
+-- every field of person() after a round trip, the enum comes back as its number
+function check_person(msg)
+    assert(msg.number == "13615632545" and msg.email == "13615632545@163.com" and msg.age == 28)
+    assert(msg.ptype == luapb:get_enum("net.PhoneType").WORK)
+    assert(#msg.desc == 3 and msg.desc[1] == "first" and msg.desc[2] == "second" and msg.desc[3] == "three")
+    assert(#msg.jobs == 2 and msg.jobs[1].jobtype == 8345 and msg.jobs[1].jobdesc == "coder")
+    assert(msg.jobs[2].jobtype == 9527 and msg.jobs[2].jobdesc == "coder2")
+end
+
+function pb_encode_test(num) 
+    local message = person()
 
     local t1 = os.clock();
     for i=1,num do
@@ -33,27 +48,62 @@ function pb_encode_test(num)
 
     print("num=".. num .."\ttime="..os.clock()-t1)
 
+    -- the same bytes every call, and they decode back to every field
+    local buffer = luapb:encode("net.tb_Person", message)
+    assert(buffer == luapb:encode("net.tb_Person", person()))
+    check_person(luapb:decode("net.tb_Person", buffer))
+    check_person(luapb:decode_reflect("net.tb_Person", buffer))
+
     print("pb_encode_test pass #\n" )
 end
 
+function pb_encode_reflect_test(num) 
+    local message = person()
+
+    local t1 = os.clock();
+    for i=1,num do
+        local buffer = luapb:encode_reflect("net.tb_Person", message)
+    end 
+
+    print("num=".. num .."\ttime="..os.clock()-t1)
+
+    local buffer = luapb:encode_reflect("net.tb_Person", message)
+    assert(buffer == luapb:encode("net.tb_Person", message))
+    check_person(luapb:decode("net.tb_Person", buffer))
+
+    -- an enum given by name or by number gives the same bytes
+    message.ptype = luapb:get_enum("net.PhoneType").WORK
+    assert(luapb:encode_reflect("net.tb_Person", message) == buffer)
+
+    print("pb_encode_reflect_test pass #\n" )
+end
+
+function pb_encode_to_test(num) 
+    local message = person()
+    local buffer = pb_buffer.new()
+
+    local t1 = os.clock();
+    for i=1,num do
+        luapb:encode_to(buffer, "net.tb_Person", message)
+        buffer:consume(buffer:size())
+    end 
+
+    print("num=".. num .."\ttime="..os.clock()-t1)
+
+    -- messages are appended, consume drops them from the front
+    local bytes = luapb:encode("net.tb_Person", message)
+    assert(luapb:encode_to(buffer, "net.tb_Person", message) == #bytes)
+    assert(luapb:encode_to(buffer, "net.tb_Person", {age = 1}) == 2)
+    assert(buffer:size() == #bytes + 2 and buffer:tostring() == bytes .. "\24\1")
+    buffer:consume(#bytes)
+    assert(buffer:tostring() == "\24\1")
+    check_person(luapb:decode("net.tb_Person", bytes))
+
+    print("pb_encode_to_test pass #\n" )
+end
+
 function pb_decode_test(num) 
-    local message = {
-        number = "13615632545",
-        email = "13615632545@163.com",
-        age = 28,
-        ptype = "WORK",
-        desc = {"first", "second", "three"},
-        jobs = {
-            {
-                jobtype = 8345,
-                jobdesc = "coder"
-            },
-            {
-                jobtype = 9527,
-                jobdesc = "coder2"
-            }
-        }
-    }
+    local message = person()
     local buffer = luapb:encode("net.tb_Person", message)
 
     local t1 = os.clock();
@@ -65,8 +115,854 @@ function pb_decode_test(num)
     
     --print("pb_table_test:  " .. bin2hex(buffer))
 
+    check_person(luapb:decode("net.tb_Person", buffer))
+    -- the bytes of a frame, and a truncated buffer that fails to an empty table
+    check_person(luapb:decode("net.tb_Person", "head" .. buffer .. "tail", 5, 4 + #buffer))
+    assert(next(luapb:decode("net.tb_Person", buffer:sub(1, -2))) == nil)
+    -- options may follow the start of the frame alone
+    local person_type = luapb:type("net.tb_Person")
+    check_person(luapb:decode("net.tb_Person", "head" .. buffer, 5, {defaults = "omit"}))
+    check_person(person_type:decode("head" .. buffer, 5, {defaults = "omit"}))
+    check_person(luapb:decode_lazy("net.tb_Person", "head" .. buffer, 5, {defaults = "omit"}))
+    -- anything but a string is an argument error, not an empty message
+    local ok, err = pcall(luapb.decode, luapb, "net.tb_Person", 42)
+    assert(not ok and err:find("bad argument #3", 1, true) and err:find("string expected, got number", 1, true))
+    ok, err = pcall(person_type.decode, person_type, {})
+    assert(not ok and err:find("string expected, got table", 1, true))
+    ok, err = pcall(luapb.decode_into, luapb, "net.tb_Person", nil, {})
+    assert(not ok and err:find("string expected, got nil", 1, true))
+
     print("pb_decode_test pass #\n" )
 end
 
+function pb_decode_reflect_test(num) 
+    local message = person()
+    local buffer = luapb:encode("net.tb_Person", message)
+
+    local t1 = os.clock();
+    for i=1,num do
+        local msg = luapb:decode_reflect("net.tb_Person", buffer)
+    end 
+
+    print("num=".. num .."\ttime="..os.clock()-t1)
+
+    check_person(luapb:decode("net.tb_Person", buffer))
+    check_person(luapb:decode_reflect("net.tb_Person", buffer))
+
+    print("pb_decode_reflect_test pass #\n" )
+end
+
+function pb_decode_into_test(num) 
+    local message = person()
+    local buffer = luapb:encode("net.tb_Person", message)
+    local msg = {}
+
+    local t1 = os.clock();
+    for i=1,num do
+        luapb:decode_into("net.tb_Person", buffer, msg)
+    end 
+
+    print("num=".. num .."\ttime="..os.clock()-t1)
+
+    check_person(msg)
+
+    -- a table holding a longer message is trimmed, its job tables are decoded in place
+    local longer = person()
+    longer.jobs[3] = {jobtype = 1, jobdesc = "third"}
+    longer.desc[4] = "four"
+    luapb:decode_into("net.tb_Person", luapb:encode("net.tb_Person", longer), msg)
+    local job = msg.jobs[1]
+    assert(#msg.jobs == 3 and #msg.desc == 4)
+    msg.extra = true
+    luapb:decode_into("net.tb_Person", buffer, msg)
+    check_person(msg)
+    assert(msg.jobs[1] == job and msg.jobs[3] == nil and msg.desc[4] == nil and msg.extra == nil)
+
+    -- a field missing from the wire goes back to its default
+    luapb:decode_into("net.tb_Person", luapb:encode("net.tb_Person", {age = 1}), msg)
+    assert(msg.age == 1 and msg.email == "" and #msg.jobs == 0 and #msg.desc == 0)
+
+    print("pb_decode_into_test pass #\n" )
+end
+
+function pb_many_test(num) 
+    local message = person()
+    local batch = {}
+    for i=1,100 do
+        batch[i] = message
+    end
+
+    local t1 = os.clock();
+    for i=1,num/100 do
+        local msgs = luapb:decode_many("net.tb_Person", luapb:encode_many("net.tb_Person", batch))
+    end 
+
+    print("num=".. num .."\ttime="..os.clock()-t1)
+
+    local msgs = luapb:decode_many("net.tb_Person", luapb:encode_many("net.tb_Person", batch))
+    assert(#msgs == 100 and msgs[100].jobs[2].jobdesc == "coder2")
+    local split = luapb:encode_many("net.tb_Person", batch, true)
+    assert(#split == 100 and split[1] == luapb:encode("net.tb_Person", message))
+
+    -- a message that fails to encode fails the batch and names its index
+    local bad = {message, message, {jobs = {1}}, message}
+    for _, flag in ipairs({false, true}) do
+        local buffer, index = luapb:encode_many("net.tb_Person", bad, flag)
+        assert(buffer == nil and index == 3)
+        buffer, index = luapb:type("net.tb_Person"):encode_many({message, 1}, flag)
+        assert(buffer == nil and index == 2)
+    end
+    -- the scratch buffer is left as it was for the next batch
+    assert(luapb:encode_many("net.tb_Person", {message}) == string.char(#split[1]) .. split[1])
+
+    -- a message that fails to parse fails the batch the same way, in a stream or an array
+    local stream = luapb:encode_many("net.tb_Person", {message, message, message})
+    local index
+    msgs, index = luapb:decode_many("net.tb_Person", stream .. "\5\255\255")
+    assert(msgs == nil and index == 4)
+    msgs, index = luapb:type("net.tb_Person"):decode_many("head" .. stream .. "\5\255\255", 5)
+    assert(msgs == nil and index == 4)
+    msgs, index = luapb:type("net.tb_Person"):decode_many("head" .. stream .. "tail", 5, 4 + #stream)
+    assert(#msgs == 3 and index == nil and msgs[3].jobs[2].jobdesc == "coder2")
+    for _, handle in ipairs({luapb, luapb:type("net.tb_Person")}) do
+        local bad = {split[1], split[2], "\10\5ab", split[3]}
+        if handle == luapb then
+            msgs, index = handle:decode_many("net.tb_Person", bad)
+        else
+            msgs, index = handle:decode_many(bad)
+        end
+        assert(msgs == nil and index == 3)
+    end
+
+    print("pb_many_test pass #\n" )
+end
+
+function pb_type_test(num) 
+    local message = person()
+    local person = luapb:type("net.tb_Person")
+
+    local t1 = os.clock();
+    for i=1,num do
+        local msg = person:decode(person:encode(message))
+    end 
+
+    print("num=".. num .."\ttime="..os.clock()-t1)
+
+    local buffer = person:encode(message)
+    assert(buffer == luapb:encode("net.tb_Person", message) and buffer == person:encode_reflect(message))
+    assert(person:name() == "net.tb_Person")
+    check_person(person:decode(buffer))
+    check_person(person:decode_reflect(buffer))
+    check_person(person:decode_lazy(buffer))
+    local msg = {}
+    person:decode_into(buffer, msg)
+    check_person(msg)
+
+    print("pb_type_test pass #\n" )
+end
+
+-- reflection encode and decode inside an arena that is reset once per simulated tick
+function pb_arena_test(num) 
+    local message = person()
+    local arena = luapb:arena()
+
+    local t1 = os.clock();
+    for i=1,num do
+        local msg = luapb:decode_reflect("net.tb_Person", luapb:encode_reflect("net.tb_Person", message))
+        if i % 100 == 0 then
+            arena:reset()
+        end
+    end 
+
+    print("num=".. num .."\ttime="..os.clock()-t1)
+
+    -- tables decoded in the arena outlive a reset, they hold lua values only
+    local buffer = luapb:encode_reflect("net.tb_Person", message)
+    local msg = luapb:decode_reflect("net.tb_Person", buffer)
+    arena:reset()
+    assert(buffer == luapb:encode("net.tb_Person", message))
+    check_person(msg)
+    arena:close()
+    check_person(luapb:decode_reflect("net.tb_Person", luapb:encode_reflect("net.tb_Person", message)))
+
+    -- an error raised mid-encode reaches the caller and leaves no call in progress behind
+    local failing = setmetatable({number = "x"}, {__index = function() error("boom") end})
+    for _, encode in ipairs({luapb.encode_reflect, luapb.encode}) do
+        local ok, err = pcall(encode, luapb, "net.tb_Person", failing)
+        assert(not ok and string.find(err, "boom"))
+        arena = luapb:arena()
+        assert(arena ~= nil)
+        arena:close()
+    end
+    -- also when a metamethod catches the error of a call it makes itself
+    local nested = setmetatable({}, {__index = function(t, k)
+        assert(not pcall(luapb.encode_reflect, luapb, "net.tb_Person", failing))
+        return nil
+    end})
+    nested.number = "13615632545"
+    assert(luapb:encode_reflect("net.tb_Person", nested) == luapb:encode("net.tb_Person", {number = "13615632545"}))
+    arena = luapb:arena()
+    assert(arena ~= nil)
+    arena:close()
+
+    -- a coroutine gets its tables on its own stack
+    check_person(coroutine.wrap(function()
+        return luapb:decode_reflect("net.tb_Person", luapb:encode_reflect("net.tb_Person", message))
+    end)())
+
+    print("pb_arena_test pass #\n" )
+end
+
+-- google.protobuf.DescriptorProto nests itself through nested_type, no extra .proto is needed
+function pb_nesting_test(num) 
+    for _, depth in ipairs({1, 4, 16, 64}) do
+        local message = {name = "L0"}
+        local curr = message
+        for i = 1, depth do
+            local sub = {name = "L" .. i}
+            curr.nested_type = {sub}
+            curr = sub
+        end
+
+        -- the same number of messages at every depth
+        local count = num // (depth + 1)
+        local t1 = os.clock();
+        for i=1,count do
+            local msg = luapb:encode_reflect("google.protobuf.DescriptorProto", message)
+        end 
+
+        print("depth=".. depth .."\tnum=".. count .."\ttime="..os.clock()-t1)
+
+        assert(luapb:encode_reflect("google.protobuf.DescriptorProto", message) == luapb:encode("google.protobuf.DescriptorProto", message))
+    end
+
+    print("pb_nesting_test pass #\n" )
+end
+
+-- a one field message keeps the codec cheap, so the timings are mostly per call binding overhead
+function pb_call_overhead_test(num) 
+    local message = {
+        age = 28
+    }
+    local buffer = luapb:encode("net.tb_Person", message)
+    local reuse = {}
+
+    local t1 = os.clock();
+    for i=1,num do
+        luapb:encode("net.tb_Person", message)
+    end 
+    print("encode\tnum=".. num .."\ttime="..os.clock()-t1)
+
+    t1 = os.clock();
+    for i=1,num do
+        luapb:decode("net.tb_Person", buffer)
+    end 
+    print("decode\tnum=".. num .."\ttime="..os.clock()-t1)
+
+    t1 = os.clock();
+    for i=1,num do
+        luapb:decode_into("net.tb_Person", buffer, reuse)
+    end 
+    print("decode_into\tnum=".. num .."\ttime="..os.clock()-t1)
+
+    t1 = os.clock();
+    for i=1,num do
+        luapb:get_enum("net.PhoneType")
+    end 
+    print("get_enum\tnum=".. num .."\ttime="..os.clock()-t1)
+
+    assert(reuse.age == 28)
+
+    print("pb_call_overhead_test pass #\n" )
+end
+
+-- reads two fields of a decoded message, the lazy proxy leaves the repeated ones encoded
+function pb_lazy_test(num) 
+    local message = person()
+    local buffer = luapb:encode("net.tb_Person", message)
+
+    local t1 = os.clock();
+    for i=1,num do
+        local msg = luapb:decode("net.tb_Person", buffer)
+        local age, email = msg.age, msg.email
+    end 
+    print("decode\tnum=".. num .."\ttime="..os.clock()-t1)
+
+    t1 = os.clock();
+    for i=1,num do
+        local msg = luapb:decode_lazy("net.tb_Person", buffer)
+        local age, email = msg.age, msg.email
+    end 
+    print("decode_lazy\tnum=".. num .."\ttime="..os.clock()-t1)
+
+    local msg = luapb:decode_lazy("net.tb_Person", buffer)
+    check_person(msg)
+
+    -- a field assigned nil stays nil, # and pairs follow the keys as on a plain decoded table
+    local plain = luapb:decode("net.tb_Person", buffer)
+    msg = luapb:decode_lazy("net.tb_Person", buffer)
+    msg.email = nil
+    plain.email = nil
+    assert(msg.email == nil and msg.number == message.number)
+    assert(#msg == #plain)
+    msg[1], msg[2] = "x", "y"
+    plain[1], plain[2] = "x", "y"
+    assert(#msg == 2 and #msg == #plain and msg[2] == "y")
+    msg.email = "again"
+    assert(msg.email == "again")
+    local seen = {}
+    for k, v in pairs(msg) do seen[k] = v end
+    assert(seen.email == "again" and seen[1] == "x" and seen.age == 28 and type(seen.jobs) == "table")
+    msg.email = nil
+    msg[2] = nil
+    seen = {}
+    for k, v in pairs(msg) do seen[k] = v end
+    assert(seen.email == nil and seen[2] == nil and seen[1] == "x" and #msg == 1)
+
+    print("pb_lazy_test pass #\n" )
+end
+
+-- a router reads two fields, the projection skips the rest on the wire
+function pb_projection_test(num) 
+    local message = person()
+    local buffer = luapb:encode("net.tb_Person", message)
+    local options = {fields = luapb:projection("net.tb_Person", {"age", "jobs.jobtype"})}
+
+    local t1 = os.clock();
+    for i=1,num do
+        local msg = luapb:decode("net.tb_Person", buffer, options)
+    end 
+    print("num=".. num .."\ttime="..os.clock()-t1)
+
+    local msg = luapb:decode("net.tb_Person", buffer, options)
+    assert(msg.age == 28 and msg.email == nil and msg.number == nil and msg.desc == nil)
+    assert(#msg.jobs == 2 and msg.jobs[1].jobtype == 8345 and msg.jobs[2].jobtype == 9527 and msg.jobs[2].jobdesc == nil)
+    -- decode_into with the projection leaves only the selected fields
+    local into = luapb:decode("net.tb_Person", buffer)
+    luapb:decode_into("net.tb_Person", buffer, into, options)
+    assert(into.age == 28 and into.email == nil and into.jobs[1].jobdesc == nil)
+
+    print("pb_projection_test pass #\n" )
+end
+
+-- a sparse message decoded with and without the unset fields
+function pb_defaults_test(num) 
+    local message = {
+        age = 28
+    }
+    local buffer = luapb:encode("net.tb_Person", message)
+
+    for _, mode in ipairs({"fill", "omit", "metatable"}) do
+        local options = {defaults = mode}
+        local t1 = os.clock();
+        for i=1,num do
+            local msg = luapb:decode("net.tb_Person", buffer, options)
+        end 
+        print(mode .."\tnum=".. num .."\ttime="..os.clock()-t1)
+    end
+
+    local msg = luapb:decode("net.tb_Person", buffer, {defaults = "omit"})
+    assert(msg.age == 28 and msg.email == nil and msg.jobs == nil)
+    msg = luapb:decode("net.tb_Person", buffer, {defaults = "metatable"})
+    assert(msg.age == 28 and msg.email == "" and #msg.jobs == 0)
+    -- the defaults are read through the metatable, only the wire fields are stored
+    assert(rawget(msg, "email") == nil and rawget(msg, "age") == 28)
+
+    -- reading a nested default leaves the record as decoded, the first write stores it
+    local options = {defaults = "metatable"}
+    local bytes = fixture:encode("test.Required", {id = 7})
+    local record = fixture:decode("test.Required", bytes, options)
+    assert(record.next.id == 0 and record.next.next.name == "none" and #record.list == 0)
+    assert(rawget(record, "next") == nil and rawget(record, "list") == nil)
+    assert(fixture:encode("test.Required", record) == bytes and fixture:encode_reflect("test.Required", record) == bytes)
+    record.next.next.id = 9
+    record.list[1] = 3
+    assert(record.next.next.id == 9 and record.list[1] == 3)
+    assert(fixture:encode("test.Required", record) == fixture:encode("test.Required", {id = 7, list = {3}, next = {id = 0, next = {id = 9}}}))
+    -- two reads of one field write to the table stored first
+    record = fixture:decode("test.Required", bytes, options)
+    local first, second = record.next, record.next
+    first.id = 1
+    second.name = "two"
+    assert(record.next == first and first.id == 1 and first.name == "two")
+    -- reading an unset oneof member does not make it the active one
+    bytes = fixture:encode("test.Choice", {number = 5})
+    local choice = fixture:decode("test.Choice", bytes, options)
+    assert(choice.item.id == 0 and choice.number == 5)
+    assert(fixture:encode("test.Choice", choice) == bytes and fixture:encode_reflect("test.Choice", choice) == bytes)
+
+    msg = luapb:decode("net.tb_Person", buffer, {defaults = "fill"})
+    assert(rawget(msg, "email") == "" and rawget(msg, "ptype") == 0 and #rawget(msg, "desc") == 0)
+
+    print("pb_defaults_test pass #\n" )
+end
+
+function pb_get_message_test(num) 
+    local t1 = os.clock();
+    for i=1,num do
+        local msg = luapb:get_message("net.tb_Person")
+    end 
+    print("num=".. num .."\ttime="..os.clock()-t1)
+
+    local options = {defaults = "metatable"}
+    t1 = os.clock();
+    for i=1,num do
+        local msg = luapb:get_message("net.tb_Person", options)
+    end 
+    print("metatable\tnum=".. num .."\ttime="..os.clock()-t1)
+
+    local msg = luapb:get_message("net.tb_Person")
+    assert(msg.age == 0 and msg.email == "" and #msg.jobs == 0)
+    msg.jobs[1] = {jobtype = 1}
+    assert(#luapb:get_message("net.tb_Person").jobs == 0)
+
+    -- a blank record holds every field and encodes with its required ones
+    local record = fixture:get_message("test.Required")
+    local count = 0
+    for k, v in pairs(record) do count = count + 1 end
+    assert(count == 4 and record.id == 0 and record.name == "none" and #record.list == 0)
+    assert(record.next.next.id == 0)
+    record.next = nil
+    local buffer = fixture:encode("test.Required", record)
+    assert(#buffer > 0 and buffer == fixture:encode_reflect("test.Required", record))
+    local back = fixture:decode("test.Required", buffer)
+    assert(back.id == 0 and back.name == "none")
+
+    -- the opt-in record holds no fields, every default is read through the shared metatable
+    record = fixture:get_message("test.Required", options)
+    assert(next(record) == nil and getmetatable(record) == getmetatable(fixture:get_message("test.Required", options)))
+    assert(record.id == 0 and record.name == "none" and #record.list == 0 and record.next.next.id == 0)
+    record.list[1] = 5
+    assert(#fixture:get_message("test.Required", options).list == 0)
+    msg = luapb:get_message("net.tb_Person", options)
+    assert(next(msg) == nil and msg.age == 0 and msg.email == "" and msg.ptype == 0 and #msg.desc == 0 and #msg.jobs == 0)
+
+    -- it encodes its required fields with their defaults, the others as unset
+    record = fixture:get_message("test.Required", options)
+    buffer = fixture:encode("test.Required", record)
+    assert(buffer == fixture:encode("test.Required", {id = 0}) and buffer == fixture:encode_reflect("test.Required", record))
+    assert(fixture:encode("test.Wide", fixture:get_message("test.Wide", options)) == fixture:encode("test.Wide", {id = 0}))
+
+    print("pb_get_message_test pass #\n" )
+end
+
+function pb_enum_test(num) 
+    local message = {number = "13615632545", age = 28, ptype = "WORK"}
+    local t1 = os.clock();
+    for i=1,num do
+        local msg = luapb:decode("net.tb_Person", luapb:encode("net.tb_Person", message), {enums = "name"})
+    end 
+    print("num=".. num .."\ttime="..os.clock()-t1)
+
+    -- every call hands out its own table, next and writes behave as on any table
+    local types = luapb:get_enum("net.PhoneType")
+    assert(types ~= luapb:get_enum("net.PhoneType") and types.WORK == 2 and next(types) ~= nil)
+    local count = 0
+    for k, v in pairs(types) do count = count + 1 end
+    assert(count == 3)
+    types.WORK = 99
+    rawset(types, "EXTRA", 7)
+    assert(luapb:get_enum("net.PhoneType").WORK == 2 and luapb:get_enum("net.PhoneType").EXTRA == nil)
+    types.WORK = 2
+
+    -- the frozen table is cached, one per enum, and ignores writes
+    local options = {frozen = true}
+    t1 = os.clock();
+    for i=1,num do
+        local frozen = luapb:get_enum("net.PhoneType", options)
+    end 
+    print("frozen\tnum=".. num .."\ttime="..os.clock()-t1)
+    local frozen = luapb:get_enum("net.PhoneType", options)
+    assert(frozen == luapb:get_enum("net.PhoneType", options) and frozen ~= types)
+    assert(frozen.WORK == 2 and frozen.EXTRA == nil and getmetatable(frozen) == false)
+    count = 0
+    for k, v in pairs(frozen) do
+        assert(types[k] == v)
+        count = count + 1
+    end
+    assert(count == 3)
+    frozen.WORK = 99
+    assert(luapb:get_enum("net.PhoneType", options).WORK == 2 and rawget(frozen, "WORK") == nil)
+
+    local msg = luapb:decode("net.tb_Person", luapb:encode("net.tb_Person", message), {enums = "name"})
+    assert(msg.ptype == "WORK")
+    assert(luapb:decode("net.tb_Person", luapb:encode("net.tb_Person", message)).ptype == types.WORK)
+
+    print("pb_enum_test pass #\n" )
+end
+
+-- only the active member of a oneof is decoded, and one member is encoded on both encode paths
+function pb_oneof_test(num) 
+    local message = {text = "hello", other = 1, body_case = "text"}
+    local options = {oneof_case = true}
+
+    local t1 = os.clock();
+    for i=1,num do
+        local msg = fixture:decode("test.Choice", fixture:encode("test.Choice", message), options)
+    end 
+    print("num=".. num .."\ttime="..os.clock()-t1)
+
+    local text = fixture:encode("test.Choice", {text = "hello"})
+    local number = fixture:encode("test.Choice", {number = 5})
+    local msg = fixture:decode("test.Choice", text, options)
+    assert(msg.text == "hello" and msg.number == nil and msg.item == nil and msg.body_case == "text")
+
+    -- the last member on the wire replaces the earlier ones
+    msg = fixture:decode("test.Choice", text .. number, options)
+    assert(msg.number == 5 and msg.text == nil and msg.body_case == "number")
+    fixture:decode_into("test.Choice", text, msg, options)
+    assert(msg.text == "hello" and msg.number == nil and msg.body_case == "text")
+    local ref = fixture:decode_reflect("test.Choice", text .. number)
+    assert(ref.number == 5 and ref.text == nil and ref.item == nil)
+
+    -- a case naming a member the table does not hold falls back to the member that is set
+    local stale = {number = 5, body_case = "text"}
+    assert(fixture:encode("test.Choice", stale) == number and fixture:encode_reflect("test.Choice", stale) == number)
+
+    -- with two members set the last one in field order is kept, as reflection does
+    local both = {number = 5, text = "hello"}
+    assert(fixture:encode("test.Choice", both) == text and fixture:encode_reflect("test.Choice", both) == text)
+    both.body_case = "number"
+    assert(fixture:encode("test.Choice", both) == number and fixture:encode_reflect("test.Choice", both) == number)
+
+    -- a case that is not a member fails the encode
+    assert(fixture:encode("test.Choice", {number = 5, body_case = "other"}) == "")
+
+    -- round trip of a nested member
+    msg = fixture:decode("test.Choice", fixture:encode("test.Choice", {item = {id = 7}}), options)
+    assert(msg.item.id == 7 and msg.body_case == "item")
+    assert(fixture:get_message("test.Choice").number == nil)
+
+    print("pb_oneof_test pass #\n" )
+end
+
+function pb_group_test(num) 
+    local message = {item = {a = 1, b = "one"}, row = {{x = 2}, {x = 3}}, tail = 4}
+
+    local t1 = os.clock();
+    for i=1,num do
+        local msg = fixture:decode("test.Grouped", fixture:encode("test.Grouped", message))
+    end 
+    print("num=".. num .."\ttime="..os.clock()-t1)
+
+    -- groups are written between START_GROUP and END_GROUP tags, as reflection writes them
+    local buffer = fixture:encode("test.Grouped", message)
+    assert(buffer ~= "" and buffer == fixture:encode_reflect("test.Grouped", message))
+
+    local msg = fixture:decode("test.Grouped", buffer)
+    assert(msg.item.a == 1 and msg.item.b == "one" and #msg.row == 2 and msg.row[2].x == 3 and msg.tail == 4)
+    msg = fixture:decode_reflect("test.Grouped", buffer)
+    assert(msg.item.a == 1 and msg.item.b == "one" and #msg.row == 2 and msg.row[2].x == 3 and msg.tail == 4)
+    fixture:decode_into("test.Grouped", fixture:encode("test.Grouped", {row = {{x = 5}}}), msg)
+    assert(msg.item.a == 0 and #msg.row == 1 and msg.row[1].x == 5 and msg.tail == 0)
+    msg = fixture:decode_lazy("test.Grouped", buffer)
+    assert(msg.item.b == "one" and msg.row[1].x == 2 and msg.tail == 4)
+    msg = fixture:decode("test.Grouped", buffer, {fields = fixture:projection("test.Grouped", {"item.b", "tail"})})
+    assert(msg.item.b == "one" and msg.item.a == nil and msg.row == nil and msg.tail == 4)
+
+    -- a group seen twice is merged
+    msg = fixture:decode("test.Grouped", buffer .. fixture:encode("test.Grouped", {item = {a = 9}}))
+    assert(msg.item.a == 9 and msg.item.b == "one")
+
+    -- a group cut before its END_GROUP tag fails
+    assert(next(fixture:decode("test.Grouped", buffer:sub(1, 8))) == nil)
+
+    print("pb_group_test pass #\n" )
+end
+
+function pb_parity_test(num) 
+    local inputs = {
+        {"test.Required", {id = 1, list = {}, next = {id = 2}}},
+        {"test.Required", {id = 1, next = {id = 2, next = {}}}},
+        {"test.Required", {id = 1, next = {next = {}}}},
+        {"test.Choice", {item = {}}},
+        {"test.Choice", {item = {id = 3}, other = 4}},
+        {"test.Grouped", {item = {}, row = {{}, {x = 1}}}},
+        {"test.Grouped", {}},
+    }
+
+    local t1 = os.clock();
+    for i=1,num do
+        local buffer = fixture:encode_reflect("test.Grouped", inputs[6][2])
+    end 
+    print("num=".. num .."\ttime="..os.clock()-t1)
+
+    -- both encoders give the same bytes, an empty sub-table is an empty sub-message on both
+    for _, input in ipairs(inputs) do
+        assert(fixture:encode(input[1], input[2]) == fixture:encode_reflect(input[1], input[2]))
+    end
+    assert(fixture:encode("test.Required", inputs[1][2]) == "\8\1\34\2\8\2")
+    assert(fixture:encode("test.Grouped", inputs[6][2]) == "\11\12\35\36\35\40\1\36")
+
+    -- an empty Required misses its id, both fail
+    for i = 2, 4 do
+        assert(fixture:encode(inputs[i][1], inputs[i][2]) == "")
+    end
+
+    local msg = fixture:decode("test.Grouped", fixture:encode_reflect("test.Grouped", inputs[6][2]))
+    assert(msg.item.a == 0 and #msg.row == 2 and msg.row[1].x == 0 and msg.row[2].x == 1)
+
+    print("pb_parity_test pass #\n" )
+end
+
+function pb_packed_test(num) 
+    local message = {
+        s32 = {0, -1, 1, -2147483648, 2147483647},
+        s64 = {0, -1, math.mininteger, math.maxinteger},
+        f32 = {0, 1, 4294967295},
+        sf64 = {0, -1, math.mininteger, math.maxinteger},
+        d = {0.0, -1.5, 1e300, -1e-300},
+        f = {0.0, -0.5, 1024.25},
+        b = {true, false, true},
+        e = {0, 2, 1},
+    }
+    local function same(a, b)
+        for name, list in pairs(message) do
+            assert(#a[name] == #list and #b[name] == #list)
+            for i, v in ipairs(list) do
+                assert(a[name][i] == v and b[name][i] == v)
+            end
+        end
+    end
+
+    local t1 = os.clock();
+    for i=1,num do
+        local msg = fixture:decode("test.Packed", fixture:encode("test.Packed", message))
+    end 
+    print("num=".. num .."\ttime="..os.clock()-t1)
+
+    local packed = fixture:encode("test.Packed", message)
+    local unpacked = fixture:encode("test.Unpacked", message)
+    assert(packed == fixture:encode_reflect("test.Packed", message) and unpacked == fixture:encode_reflect("test.Unpacked", message))
+    assert(#packed < #unpacked)
+
+    -- each layout parses both, on the wire and the reflection paths
+    for _, name in ipairs({"test.Packed", "test.Unpacked"}) do
+        same(fixture:decode(name, packed), fixture:decode_reflect(name, packed))
+        same(fixture:decode(name, unpacked), fixture:decode_reflect(name, unpacked))
+        same(fixture:decode_lazy(name, packed), fixture:decode_lazy(name, unpacked))
+    end
+
+    -- a reused table is trimmed to what is on the wire
+    local msg = fixture:decode("test.Packed", packed .. packed)
+    assert(#msg.s32 == 10 and msg.s32[6] == 0 and msg.e[5] == 2)
+    fixture:decode_into("test.Packed", unpacked, msg)
+    same(msg, msg)
+
+    -- both layouts of the same field on one wire append to the same array
+    msg = fixture:decode("test.Packed", unpacked .. packed)
+    local ref = fixture:decode_reflect("test.Packed", unpacked .. packed)
+    assert(#msg.d == 8 and #ref.d == 8 and msg.d[5] == 0.0 and msg.d[7] == 1e300 and ref.sf64[8] == math.maxinteger)
+    assert(fixture:encode("test.Packed", msg) == fixture:encode_reflect("test.Packed", ref))
+
+    print("pb_packed_test pass #\n" )
+end
+
+function pb_sparse_test(num) 
+    local inputs = {
+        {id = 1, far = 7, f3 = "three"},
+        {id = 1, f20 = 20, list = {1, 2}, sub = {id = 2}, right = "r"},
+        {id = 1, f2 = 2, f4 = 4, f5 = 5, f6 = 6, f7 = 7},
+        {id = 1, left = 1, right = "r", pick_case = "left"},
+        {id = 1, [1] = "not a field", extra = true, f15 = 15},
+        {f2 = 2},
+        {id = 1, sub = {}},
+    }
+    -- a table with a metatable takes the dense loop
+    local function dense(t)
+        local copy = {}
+        for k, v in pairs(t) do
+            copy[k] = v
+        end
+        return setmetatable(copy, {})
+    end
+
+    local t1 = os.clock();
+    for i=1,num do
+        local buffer = fixture:encode("test.Wide", inputs[1])
+    end 
+    print("num=".. num .."\ttime="..os.clock()-t1)
+
+    -- few fields set, too many for the sparse pass, a missing required field, and failures give the dense bytes
+    for _, input in ipairs(inputs) do
+        local buffer = fixture:encode("test.Wide", input)
+        assert(buffer == fixture:encode("test.Wide", dense(input)) and buffer == fixture:encode_reflect("test.Wide", input))
+    end
+    assert(fixture:encode("test.Wide", inputs[1]) == "\8\1\26\5three\192\62\7")
+    assert(fixture:encode("test.Wide", inputs[6]) == "" and fixture:encode("test.Wide", inputs[7]) == "")
+
+    -- a table answering defaults from its metatable is read raw, the sparse pass still applies
+    local msg = fixture:decode("test.Wide", fixture:encode("test.Wide", inputs[2]), {defaults = "metatable"})
+    assert(msg.f2 == 0 and fixture:encode("test.Wide", msg) == fixture:encode("test.Wide", inputs[2]))
+
+    print("pb_sparse_test pass #\n" )
+end
+
+function pb_map_test(num) 
+    local message = {
+        names = {one = 1, two = 2, [""] = 0},
+        items = {[7] = {id = 7, list = {1, 2}}, [-1] = {id = -1, next = {id = 1}}},
+        labels = {[-5] = "minus five", [300] = ""},
+    }
+    local function check(msg)
+        assert(msg.names.one == 1 and msg.names.two == 2 and msg.names[""] == 0)
+        assert(msg.items[7].id == 7 and msg.items[7].list[2] == 2 and msg.items[-1].next.id == 1 and msg.items[-1].name == "none")
+        assert(msg.labels[-5] == "minus five" and msg.labels[300] == "")
+    end
+
+    local t1 = os.clock();
+    for i=1,num do
+        local msg = fixture:decode("test.Maps", fixture:encode("test.Maps", message))
+    end 
+    print("num=".. num .."\ttime="..os.clock()-t1)
+
+    -- entry order follows the table, so the round trips are compared rather than the bytes
+    local buffer = fixture:encode("test.Maps", message)
+    local reflected = fixture:encode_reflect("test.Maps", message)
+    assert(#buffer == #reflected)
+    for _, bytes in ipairs({buffer, reflected}) do
+        check(fixture:decode("test.Maps", bytes))
+        check(fixture:decode_reflect("test.Maps", bytes))
+        check(fixture:decode_lazy("test.Maps", bytes))
+    end
+    local msg = fixture:decode("test.Maps", buffer)
+    fixture:decode_into("test.Maps", fixture:encode("test.Maps", {names = {three = 3}}), msg)
+    assert(msg.names.three == 3 and msg.names.one == nil and next(msg.items) == nil)
+
+    -- entries written by hand: key only, value only, empty, value before key, and a key seen twice
+    local entries = "\10\3\10\1a" .. "\10\2\16\5" .. "\10\0" .. "\10\5\16\7\10\1b" .. "\10\5\10\1b\16\8"
+        .. "\18\2\8\5" .. "\18\4\18\2\8\6" .. "\26\2\8\3" .. "\26\3\18\1x"
+    for _, decoded in ipairs({fixture:decode("test.Maps", entries), fixture:decode_reflect("test.Maps", entries)}) do
+        assert(decoded.names.a == 0 and decoded.names[""] == 0 and decoded.names.b == 8)
+        assert(decoded.items[5].id == 0 and decoded.items[5].name == "none" and #decoded.items[5].list == 0)
+        assert(decoded.items[0].id == 6)
+        assert(decoded.labels[-2] == "" and decoded.labels[0] == "x")
+    end
+
+    -- a bad entry fails the encode on both paths
+    for _, bad in ipairs({{items = {[2] = "oops"}}, {labels = {[1] = {}}}, {items = {[1] = {id = 1}, [2] = {name = "no id"}}}}) do
+        assert(fixture:encode("test.Maps", bad) == "" and fixture:encode_reflect("test.Maps", bad) == "")
+    end
+
+    print("pb_map_test pass #\n" )
+end
+
+function pb_slice_test(num) 
+    local options = {bytes = "slice"}
+    -- built at run time, a constant would stay referenced by this function
+    local function source(seed)
+        local data = string.rep(seed, 64) .. "\0\255" .. seed
+        local parts = {seed, "", string.rep("p", 300) .. seed}
+        return fixture:encode("test.Blob", {data = data, parts = parts, inner = {data = seed .. seed}}), data, parts
+    end
+
+    local t1 = os.clock();
+    local buffer = source("x")
+    for i=1,num do
+        local msg = fixture:decode("test.Blob", buffer, options)
+    end 
+    print("num=".. num .."\ttime="..os.clock()-t1)
+
+    local function check(msg, seed, data, parts)
+        assert(#msg.data == #data and tostring(msg.data) == data and msg.data:tostring() == data)
+        assert(msg.data:sub(65, 66):tostring() == "\0\255" and msg.data:sub(-1):tostring() == seed and #msg.data:sub(2, 1) == 0)
+        assert(msg.data:sub(60):sub(-2):tostring() == "\255" .. seed)
+        assert(#msg.parts == 3 and tostring(msg.parts[1]) == parts[1] and #msg.parts[2] == 0 and tostring(msg.parts[3]) == parts[3])
+        assert(tostring(msg.inner.data) == seed .. seed)
+    end
+
+    -- every view pins its source: the decoded strings are dropped and collected, and new ones take their memory
+    local kept = {}
+    for i = 1, 8 do
+        local seed = string.char(64 + i)
+        local bytes, data, parts = source(seed)
+        local framed = "head" .. bytes .. "tail"
+        kept[#kept + 1] = {fixture:decode("test.Blob", bytes, options), seed, data, parts}
+        kept[#kept + 1] = {fixture:decode("test.Blob", framed, 5, 4 + #bytes, options), seed, data, parts}
+        kept[#kept + 1] = {fixture:decode_lazy("test.Blob", bytes, options), seed, data, parts}
+        local into = {}
+        fixture:decode_into("test.Blob", source("z"), into, options)
+        fixture:decode_into("test.Blob", bytes, into, options)
+        kept[#kept + 1] = {into, seed, data, parts}
+        -- a slice decoded from a slice pins the string under both
+        local outer = fixture:decode("test.Blob", fixture:encode("test.Blob", {data = bytes}), options)
+        kept[#kept + 1] = {fixture:decode("test.Blob", outer.data, options), seed, data, parts}
+    end
+    collectgarbage("collect")
+    collectgarbage("collect")
+    for i = 1, 1000 do
+        local garbage = source(string.char(i % 64 + 32))
+    end
+    collectgarbage("collect")
+    for _, entry in ipairs(kept) do
+        check(entry[1], entry[2], entry[3], entry[4])
+    end
+
+    -- a slice is taken like a string as the next decode's input, and encodes as bytes
+    local msg = kept[1][1]
+    assert(fixture:encode("test.Blob", {data = msg.data}) == fixture:encode("test.Blob", {data = kept[1][3]}))
+
+    print("pb_slice_test pass #\n" )
+end
+
+function pb_string_test(num) 
+    local long = string.rep("0123456789", 120000)
+    local message = {id = 1, name = long, list = {1}}
+
+    local t1 = os.clock();
+    for i=1,num do
+        local buffer = fixture:encode_reflect("test.Required", {id = i, name = "name"})
+    end 
+    print("num=".. num .."\ttime="..os.clock()-t1)
+
+    -- singular strings and bytes on the reflection path give the wire bytes, whatever the scratch held before
+    local inputs = {
+        {"test.Required", message},
+        {"test.Required", {id = 1, name = "short"}},
+        {"test.Required", {id = 1, name = ""}},
+        {"test.Required", {id = 1, name = "a\0b", next = {id = 2, name = "nested"}}},
+        {"test.Choice", {text = "member"}},
+        {"test.Blob", {data = "\0\1\2", inner = {data = long}}},
+        {"test.Maps", {labels = {[1] = "label"}, names = {key = 1}}},
+    }
+    for _, input in ipairs(inputs) do
+        local buffer = fixture:encode_reflect(input[1], input[2])
+        assert(buffer ~= "" and buffer == fixture:encode(input[1], input[2]))
+    end
+    local msg = fixture:decode_reflect("test.Required", fixture:encode_reflect("test.Required", message))
+    assert(msg.name == long)
+    msg = fixture:decode("test.Required", fixture:encode_reflect("test.Required", inputs[4][2]))
+    assert(msg.name == "a\0b" and msg.next.name == "nested")
+
+    -- a slice is read as the bytes it views
+    local blob = fixture:decode("test.Blob", fixture:encode("test.Blob", {data = "slice"}), {bytes = "slice"})
+    assert(fixture:encode_reflect("test.Required", {id = 1, name = blob.data}) == fixture:encode("test.Required", {id = 1, name = "slice"}))
+
+    print("pb_string_test pass #\n" )
+end
+
 pb_encode_test(1000000)
+pb_encode_reflect_test(1000000)
+pb_encode_to_test(1000000)
 pb_decode_test(1000000)
+pb_decode_reflect_test(1000000)
+pb_decode_into_test(1000000)
+pb_many_test(1000000)
+pb_type_test(1000000)
+pb_arena_test(1000000)
+pb_nesting_test(1000000)
+pb_call_overhead_test(1000000)
+pb_lazy_test(1000000)
+pb_projection_test(1000000)
+pb_defaults_test(1000000)
+pb_get_message_test(1000000)
+pb_enum_test(1000000)
+pb_oneof_test(1000000)
+pb_group_test(1000000)
+pb_parity_test(1000000)
+
+pb_packed_test(1000000)
+pb_sparse_test(1000000)
+pb_map_test(1000000)
+pb_slice_test(1000000)
+pb_string_test(1000000)
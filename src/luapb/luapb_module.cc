@@ -22,11 +22,22 @@
 #include "luapb_module.hpp"
 #include "luapb_module.h"
 
+#include <google/protobuf/arena.h>
 #include <google/protobuf/compiler/importer.h>
 #include <google/protobuf/dynamic_message.h>
+#include <google/protobuf/io/coded_stream.h>
 #include <google/protobuf/message.h>
+#include <google/protobuf/wire_format.h>
 
 #include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include <unordered_map>
+#include <vector>
 
 #ifdef WIN32
 #include <direct.h>
@@ -40,6 +51,8 @@
 
 using namespace google::protobuf;
 using namespace compiler;
+using google::protobuf::internal::WireFormat;
+using google::protobuf::internal::WireFormatLite;
 
 #define SAFE_RELEASE(x) \
   if (x) {              \
@@ -61,66 +74,942 @@ public:
 static ProtobufLibrary _protobuf_library;
 
 namespace lua_module {
+    static const int kMaxVarintBytes = 10;
+    static const int kMaxVarint32Bytes = 5;
+
+    // messages with at least this many fields may be encoded by walking the lua table instead
+    static const size_t kSparseFields = 16;
+    static const size_t kSparseSlots = 64;
+
+    // inline first block of the per call arena, reflection messages of this size never reach malloc
+    static const size_t kCallArenaBlock = 8 * 1024;
+
+    // wire format helpers, append straight to the output buffer
+    static inline void wire_varint(std::string& out, uint64 value) {
+        uint8  buf[kMaxVarintBytes];
+        uint8* end = io::CodedOutputStream::WriteVarint64ToArray(value, buf);
+        out.append(reinterpret_cast<const char*>(buf), end - buf);
+    }
+
+    static inline void wire_fixed32(std::string& out, uint32 value) {
+        uint8 buf[sizeof(value)];
+        io::CodedOutputStream::WriteLittleEndian32ToArray(value, buf);
+        out.append(reinterpret_cast<const char*>(buf), sizeof(buf));
+    }
+
+    static inline void wire_fixed64(std::string& out, uint64 value) {
+        uint8 buf[sizeof(value)];
+        io::CodedOutputStream::WriteLittleEndian64ToArray(value, buf);
+        out.append(reinterpret_cast<const char*>(buf), sizeof(buf));
+    }
+
+    static inline void wire_tag(std::string& out, int number, WireFormatLite::WireType type) {
+        wire_varint(out, WireFormatLite::MakeTag(number, type));
+    }
+
+    // length prefix is reserved as one byte at start, most sub messages fit in it
+    static inline void wire_patch_length(std::string& out, size_t start) {
+        size_t size = out.size() - start - 1;
+        if (size < 0x80) {
+            out[start] = static_cast<char>(size);
+        }
+        else {
+            uint8  buf[kMaxVarint32Bytes];
+            uint8* end = io::CodedOutputStream::WriteVarint32ToArray(static_cast<uint32>(size), buf);
+            out.replace(start, 1, reinterpret_cast<const char*>(buf), end - buf);
+        }
+    }
+
+    // varint from a bounded buffer, nullptr when truncated or longer than 10 bytes
+    static inline const uint8* wire_read_varint(const uint8* p, const uint8* end, uint64* value) {
+        if (p < end && *p < 0x80) {
+            *value = *p;
+            return p + 1;
+        }
+        uint64 result = 0;
+        for (int shift = 0; shift < 64 && p < end; shift += 7) {
+            uint8 b = *p++;
+            result |= static_cast<uint64>(b & 0x7F) << shift;
+            if (b < 0x80) {
+                *value = result;
+                return p;
+            }
+        }
+        return nullptr;
+    }
+
+    // same conversion as sol::object::as<integral>()
+    static inline int64 lua_toint64(lua_State* L, int index) {
+        if (lua_isinteger(L, index))
+            return lua_tointeger(L, index);
+        return static_cast<int64>(llround(lua_tonumber(L, index)));
+    }
+
+    // same conversion as sol's pusher<uint64>
+    static inline void lua_pushuint64(lua_State* L, uint64 value) {
+        if (value > static_cast<uint64>(std::numeric_limits<lua_Integer>::max()))
+            lua_pushnumber(L, static_cast<lua_Number>(value));
+        else
+            lua_pushinteger(L, static_cast<lua_Integer>(value));
+    }
+
+    // same answer as sol::table::empty(), without taking a reference
+    static inline bool lua_table_empty(lua_State* L, int index) {
+        lua_pushnil(L);
+        if (!lua_next(L, index))
+            return true;
+        lua_pop(L, 2);
+        return false;
+    }
+
+    // self argument of a raw binding, checked against the metatable sol registered for T
+    template <typename T>
+    static inline T* lua_checkself(lua_State* L) {
+        luaL_checkudata(L, 1, sol::usertype_traits<T>::metatable().c_str());
+        return sol::stack::get<T*>(L, 1);
+    }
+
+    // the T at index, nullptr if it is something else
+    template <typename T>
+    static inline T* lua_testobject(lua_State* L, int index) {
+        if (!luaL_testudata(L, index, sol::usertype_traits<T>::metatable().c_str()))
+            return nullptr;
+        return sol::stack::get<T*>(L, index);
+    }
+
+    static inline sol::optional<lua_Integer> lua_optinteger(lua_State* L, int index) {
+        if (lua_isnoneornil(L, index))
+            return sol::nullopt;
+        return luaL_checkinteger(L, index);
+    }
+
+    // view of bytes inside a lua string, the string is pinned as the userdata's user value
+    struct ScriptProtobufSlice {
+        const char* data;
+        size_t      size;
+    };
+
+    static const char* const kSliceMetatable = "pb_slice";
+
+    static inline ScriptProtobufSlice* lua_toslice(lua_State* L, int index) {
+        return static_cast<ScriptProtobufSlice*>(luaL_testudata(L, index, kSliceMetatable));
+    }
+
+    // pin is the stack index of the lua string that owns data
+    static inline void lua_pushslice(lua_State* L, const char* data, size_t size, int pin) {
+        ScriptProtobufSlice* slice = static_cast<ScriptProtobufSlice*>(lua_newuserdata(L, sizeof(ScriptProtobufSlice)));
+        slice->data = data;
+        slice->size = size;
+        luaL_setmetatable(L, kSliceMetatable);
+        lua_pushvalue(L, pin);
+        lua_setuservalue(L, -2);
+    }
+
+    // a string or number as lua_tolstring converts it, or the bytes a pb_slice views
+    static inline const char* lua_tobuffer(lua_State* L, int index, size_t* len) {
+        if (lua_type(L, index) == LUA_TUSERDATA) {
+            ScriptProtobufSlice* slice = lua_toslice(L, index);
+            if (!slice)
+                return nullptr;
+            *len = slice->size;
+            return slice->data;
+        }
+        return lua_tolstring(L, index, len);
+    }
+
+    // the lua string or pb_slice at index, read in place, narrowed to bytes i..j as string.sub does
+    static inline bool lua_tobytes(lua_State* L, int index, const sol::optional<lua_Integer>& i, const sol::optional<lua_Integer>& j,
+        const char** data, size_t* size) {
+        size_t      len = 0;
+        const char* str = nullptr;
+        if (lua_type(L, index) == LUA_TSTRING)
+            str = lua_tolstring(L, index, &len);
+        else if (ScriptProtobufSlice* slice = lua_toslice(L, index)) {
+            str = slice->data;
+            len = slice->size;
+        }
+        else
+            return false;
+
+        lua_Integer l = static_cast<lua_Integer>(len);
+        lua_Integer first = i ? *i : 1;
+        lua_Integer last = j ? *j : -1;
+        if (first < 0)
+            first = std::max<lua_Integer>(l + first + 1, 1);
+        else if (first == 0)
+            first = 1;
+        if (last < 0)
+            last = l + last + 1;
+        else if (last > l)
+            last = l;
+
+        if (first > last) {
+            *data = str;
+            *size = 0;
+        }
+        else {
+            *data = str + first - 1;
+            *size = static_cast<size_t>(last - first + 1);
+        }
+        return true;
+    }
+
+    // lua_tobytes of an argument, anything but a string or a pb_slice raises an argument error
+    static inline void lua_checkbytes(lua_State* L, int index, const sol::optional<lua_Integer>& i, const sol::optional<lua_Integer>& j,
+        const char** data, size_t* size) {
+        if (!lua_tobytes(L, index, i, j, data, size))
+            luaL_argerror(L, index, lua_pushfstring(L, "string expected, got %s", luaL_typename(L, index)));
+    }
+
+    // [i [, j]] [, options] from first on, either bound may be left out before the options;
+    // the index of the options table or 0
+    static inline int lua_rangeargs(lua_State* L, int first, sol::optional<lua_Integer>* i, sol::optional<lua_Integer>* j) {
+        if (lua_type(L, first) == LUA_TTABLE)
+            return first;
+        *i = lua_optinteger(L, first);
+        if (lua_type(L, first + 1) == LUA_TTABLE)
+            return first + 1;
+        *j = lua_optinteger(L, first + 1);
+        return lua_type(L, first + 2) == LUA_TTABLE ? first + 2 : 0;
+    }
+
+    static int slice_len(lua_State* L) {
+        lua_pushinteger(L, static_cast<lua_Integer>(static_cast<ScriptProtobufSlice*>(luaL_checkudata(L, 1, kSliceMetatable))->size));
+        return 1;
+    }
+
+    static int slice_tostring(lua_State* L) {
+        ScriptProtobufSlice* slice = static_cast<ScriptProtobufSlice*>(luaL_checkudata(L, 1, kSliceMetatable));
+        lua_pushlstring(L, slice->data, slice->size);
+        return 1;
+    }
+
+    // slice:sub(i [, j]), a narrower view of the same string
+    static int slice_sub(lua_State* L) {
+        luaL_checkudata(L, 1, kSliceMetatable);
+        const char* data = nullptr;
+        size_t      size = 0;
+        lua_tobytes(L, 1, luaL_checkinteger(L, 2), lua_optinteger(L, 3), &data, &size);
+        lua_getuservalue(L, 1);
+        lua_pushslice(L, data, size, lua_gettop(L));
+        return 1;
+    }
+
+    static const char* const kLazyMetatable = "pb_lazy";
+
+    // cached for a field assigned nil, its address is the light userdata stored
+    static const char kLazyTombstone = 0;
+
+    // the string or the string under the pb_slice at index, what a view of it must pin
+    static inline int lua_pushsource(lua_State* L, int index) {
+        if (lua_toslice(L, index))
+            lua_getuservalue(L, index);
+        else
+            lua_pushvalue(L, index);
+        return lua_gettop(L);
+    }
+
+    static void register_slice(lua_State* L) {
+        static const luaL_Reg methods[] = {
+            { "sub", slice_sub },
+            { "tostring", slice_tostring },
+            { nullptr, nullptr },
+        };
+        luaL_newmetatable(L, kSliceMetatable);
+        lua_pushcfunction(L, slice_len);
+        lua_setfield(L, -2, "__len");
+        lua_pushcfunction(L, slice_tostring);
+        lua_setfield(L, -2, "__tostring");
+        luaL_newlib(L, methods);
+        lua_setfield(L, -2, "__index");
+        lua_pop(L, 1);
+    }
+
+    // growable output buffer owned by the caller, messages are appended and flushed from the front
+    class ScriptProtobufBuffer {
+    public:
+        ScriptProtobufBuffer();
+
+    public:
+        size_t            Size() const;
+        sol::stack_object ToString(sol::this_state s) const;
+        void              Consume(size_t n);
+        void              Clear();
+
+        const char*  data() const;
+        std::string& storage();
+
+    private:
+        std::string m_data;
+        size_t      m_head;  // bytes already consumed from the front of m_data
+    };
+
+    ScriptProtobufBuffer::ScriptProtobufBuffer()
+        : m_head(0) {
+    }
+
+    size_t ScriptProtobufBuffer::Size() const {
+        return m_data.size() - m_head;
+    }
+
+    sol::stack_object ScriptProtobufBuffer::ToString(sol::this_state s) const {
+        lua_pushlstring(s, data(), Size());
+        return sol::stack_object(s, lua_gettop(s));
+    }
+
+    void ScriptProtobufBuffer::Consume(size_t n) {
+        m_head += std::min(n, Size());
+        if (m_head == m_data.size()) {
+            Clear();
+        }
+        else if (m_head > m_data.size() / 2) {
+            m_data.erase(0, m_head);
+            m_head = 0;
+        }
+    }
+
+    void ScriptProtobufBuffer::Clear() {
+        m_data.clear();
+        m_head = 0;
+    }
+
+    const char* ScriptProtobufBuffer::data() const {
+        return m_data.data() + m_head;
+    }
+
+    std::string& ScriptProtobufBuffer::storage() {
+        return m_data;
+    }
+
+    class ScriptProtobufArena;
+    class ScriptProtobufProjection;
+
     class ScriptProtobuf {
+        friend class ScriptProtobufType;
+        friend class ScriptProtobufArena;
+        friend class ScriptProtobufProjection;
+
     public:
         ScriptProtobuf(sol::this_state L, const std::string& file);
         ~ScriptProtobuf();
 
     public:
-        std::string Encode(const char* structName, const sol::table& tab);
-        sol::table  Decode(const char* structName, const std::string& msg);
-        sol::table  GetEnum(const char* structName);
-        sol::table  GetStruct(const char* structName);
+        // hot path, raw lua_CFunction bindings
+        static int Encode(lua_State* L);      // pb:encode(name, tab)
+        static int Decode(lua_State* L);      // pb:decode(name, bytes [, i [, j]] [, options])
+        static int DecodeInto(lua_State* L);  // pb:decode_into(name, bytes, tab [, i [, j]] [, options])
+        static int GetEnum(lua_State* L);     // pb:get_enum(name [, options])
+        static int GetStruct(lua_State* L);   // pb:get_message(name [, options])
+        static int DecodeLazy(lua_State* L);  // pb:decode_lazy(name, bytes [, i [, j]] [, options])
+        static int EncodeMany(lua_State* L);  // pb:encode_many(name, array [, split])
+        static int DecodeMany(lua_State* L);  // pb:decode_many(name, msgs [, i [, j]])
+        static int EncodeReflect(lua_State* L);  // pb:encode_reflect(name, tab)
+        static int DecodeReflect(lua_State* L);  // pb:decode_reflect(name, bytes [, i [, j]])
+
+        // F in a protected call on the pb OWNER finds, the state a lua error unwinds past is put back
+        // before the error is raised again; every binding that encodes or decodes goes through it
+        template <ScriptProtobuf* (*OWNER)(lua_State*), lua_CFunction F>
+        static int Guard(lua_State* L) {
+            return OWNER(L)->protected_call(L, F);
+        }
+        static ScriptProtobuf* Owner(lua_State* L);
+        static ScriptProtobuf* LazyOwner(lua_State* L);
+
+        // pb_lazy metamethods
+        static int LazyIndex(lua_State* L);
+        static int LazyNewIndex(lua_State* L);
+        static int LazyPairs(lua_State* L);
+        static int LazyNext(lua_State* L);
+        static int LazyLen(lua_State* L);
+
+    public:
+        size_t            EncodeTo(ScriptProtobufBuffer& buffer, const char* structName, const sol::table& tab);
+
+        static sol::object Type(sol::object self, const char* structName, sol::this_state s);
+        static sol::object OpenArena(sol::object self, sol::this_state s);
+        static sol::object Projection(sol::object self, const char* structName, sol::table paths, sol::this_state s);
 
     private:
+        // arena of one reflection call: the open one, else m_call_arena, reset when the outermost call returns
+        struct ArenaScope {
+            explicit ArenaScope(ScriptProtobuf* owner);
+            ~ArenaScope();
+
+            ScriptProtobuf* owner;
+            Arena*          arena;
+        };
+
         bool     load_proto_file(const std::string& file);
-        Message* create_message(const std::string& typeName);
+        Message* create_message(const std::string& typeName, Arena* arena);
+        void     release_message(Message* message, Arena* arena);
+
+        void       get_enum(lua_State* L, const char* structName, bool frozen);
+        void       get_struct(lua_State* L, const char* structName, bool shared);
+
+        const Descriptor* find_message_descriptor(const std::string& typeName);
+        const Message*    find_prototype(const Descriptor* descriptor);
 
         const EnumDescriptor* find_enum_descriptor(const std::string& enumName);
 
         bool load_root_proto(const std::string& file);
 
-        Message* lua2protobuf(const std::string& pbName, const sol::table& tab);
-        void     protobuf2lua(const Message& message, sol::table& root);
+        bool lua2protobuf(lua_State* L, int index, Message* message);
+        void protobuf2lua(lua_State* L, int index, const Message& message);
 
-        bool single_field_lua2pb(Message* message, const Reflection* reflection, const FieldDescriptor* fd, const sol::object& source);
-        bool repeated_field_lua2pb(Message* message, const Reflection* reflection, const FieldDescriptor* fd, const sol::object& source);
+        bool                       single_field_lua2pb(lua_State* L, int index, Message* message, const Reflection* reflection, const FieldDescriptor* fd);
+        bool                       repeated_field_lua2pb(lua_State* L, int index, Message* message, const Reflection* reflection, const FieldDescriptor* fd);
+        bool                       map_field_lua2pb(lua_State* L, int index, Message* message, const Reflection* reflection, const FieldDescriptor* fd);
+        bool                       sub_message_lua2pb(lua_State* L, int index, const FieldDescriptor* fd, Message* sub);
+        const EnumValueDescriptor* enum_lua2pb(lua_State* L, int index, const EnumDescriptor* enumDescriptor);
 
-        template <typename T>
-        bool         single_field_pb2lua(const Message& message, const Reflection* reflection, const FieldDescriptor* fd, sol::table& dest, const T& name);
-        bool         repeated_field_pb2lua(const Message& message, const Reflection* reflection, const FieldDescriptor* fd, sol::table& sub);
-        bool         map_field_pb2lua(const Message& message, const Reflection* reflection, const FieldDescriptor* fd, sol::table& sub);
+        bool single_field_pb2lua(lua_State* L, const Message& message, const Reflection* reflection, const FieldDescriptor* fd);
+        bool repeated_field_pb2lua(lua_State* L, int index, const Message& message, const Reflection* reflection, const FieldDescriptor* fd);
+        bool map_field_pb2lua(lua_State* L, int index, const Message& message, const Reflection* reflection, const FieldDescriptor* fd);
         sol::object& map_key(const Message& message, const Reflection* reflection, const FieldDescriptor* fd, sol::table& source);
 
+        // compiled per message layout, built once per Descriptor and cached
+        struct FieldPlan;
+        struct MessagePlan;
+        struct EnumPlan;
+        typedef bool (ScriptProtobuf::*FieldEncoder)(lua_State* L, int index, const FieldPlan& field, std::string& out, bool* zero);
+        typedef bool (ScriptProtobuf::*FieldDecoder)(lua_State* L, const FieldPlan& field, io::CodedInputStream& input);
+        typedef void (ScriptProtobuf::*PackedEncoder)(lua_State* L, int array, size_t size, std::string& out);
+        typedef bool (ScriptProtobuf::*PackedDecoder)(lua_State* L, int array, lua_Integer* n, const uint8* data, size_t size);
+
+        enum FieldKind {
+            FIELD_SINGLE,
+            FIELD_REPEATED,
+            FIELD_PACKED,
+            FIELD_MAP,
+        };
+
+        struct FieldPlan {
+            const FieldDescriptor*   fd;
+            FieldKind                kind;
+            WireFormatLite::WireType wire_type;                // wire type of one value
+            uint8                    tag[kMaxVarint32Bytes];  // ahead of each value, or of the packed block / map entry
+            int                      tag_size;
+            bool                     packable;
+            bool                     required;
+            bool                     proto3;
+            bool                     skip_zero;  // proto3 scalars equal to their default are not serialized
+            int                      key;        // interned field name, registry reference
+            FieldEncoder             encode;
+            FieldDecoder             decode;
+            PackedEncoder            packed_encode;  // whole packed block of a numeric type, else nullptr
+            PackedDecoder            packed_decode;
+            const MessagePlan*       message;    // message type, or the map entry
+            const EnumPlan*          enumeration; // enum type, else nullptr
+            int                      oneof;      // index in the message's oneofs, -1 if none
+        };
+
+        // values of one enum, built once per EnumDescriptor and cached
+        struct EnumPlan {
+            const EnumDescriptor* descriptor;
+            int                   values;  // name -> number, registry reference
+            int                   names;   // number -> interned name, the first of aliased names, registry reference
+            int                   frozen;  // read-only view of values for get_enum {frozen = true}, registry reference, LUA_NOREF until used
+        };
+
+        struct OneofPlan {
+            int              key;    // interned "<oneof>_case", registry reference
+            std::vector<int> slots;  // member fields, plan slots
+        };
+
+        struct MessagePlan {
+            const Descriptor*            descriptor;
+            std::vector<FieldPlan>       fields;   // field number order
+            std::vector<int>             numbers;  // field number -> fields slot, -1 if none
+            std::unordered_map<int, int> sparse;   // field numbers past numbers
+            int                          names;    // field name -> slot + 1, registry reference
+            mutable int                  defaults[2]; // metatable serving unset fields, by enum names off / on, registry reference, LUA_NOREF until used
+            std::vector<OneofPlan>       oneofs;   // oneof declaration order
+            int                          required; // count of required fields
+            bool                         has_repeated;
+
+            const FieldPlan* find(int number) const;
+        };
+
+        // fields of one message selected by projection paths
+        struct ProjectionNode {
+            const MessagePlan*                           plan;
+            bool                                         whole;  // the field itself was named, decoded in full
+            std::vector<std::unique_ptr<ProjectionNode>> slots;  // by plan slot, nullptr skips the field
+        };
+
+        // what a decoded table holds for a field missing from the wire
+        enum DefaultsMode {
+            DEFAULTS_FILL,       // its default value, or an empty table
+            DEFAULTS_OMIT,       // nothing
+            DEFAULTS_METATABLE,  // nothing, the type's defaults metatable answers reads
+        };
+
+        // per call decode settings, from the options table of decode / decode_into
+        struct DecodeOptions {
+            DecodeOptions();
+
+            bool                  bytes_slice;  // {bytes = "slice"}, bytes fields as pb_slice views of the source
+            int                   source;       // stack index of the string the slices pin
+            const ProjectionNode* fields;       // {fields = ...}, nullptr decodes every field
+            DefaultsMode          defaults;     // {defaults = "fill" | "omit" | "metatable"}
+            bool                  oneof_case;   // {oneof_case = true}, "<oneof>_case" names the member that is set
+            bool                  enum_names;   // {enums = "name"}, enum values as their interned names
+        };
+
+        // what a call changes and puts back as it returns, a lua error skips the C++ that would
+        struct CallState {
+            int           arena_depth;
+            Arena*        current_arena;
+            bool          encoding;
+            bool          encode_raw;
+            DecodeOptions decode;
+            size_t        default_chain;
+        };
+
+        int protected_call(lua_State* L, lua_CFunction body);
+
+        enum DecodeMode {
+            DECODE_NEW,    // fresh table, unset fields get defaults
+            DECODE_MERGE,  // into a table decoded already, as a repeated singular message
+            DECODE_REUSE,  // into a caller table, reusing its sub-tables
+        };
+
+        // per field decode state of one message
+        struct FieldState {
+            bool        seen;
+            int         hint;   // elements on the wire, sizes the lua table
+            lua_Integer size;   // elements in the lua table, -1 until first touched
+            lua_Integer stale;  // elements of a reused array before decoding
+        };
+
+        // occurrences of one field in a lazily decoded message, offsets of the first and last tag
+        struct LazyField {
+            uint32 first;
+            uint32 last;
+            uint32 count;
+        };
+
+        // pb_lazy userdata, one LazyField per plan slot follows; the user value pins the source string [1]
+        // and the pb object [2], [3] is the cache of decoded fields and assigned keys
+        struct LazyMessage {
+            ScriptProtobuf*    owner;
+            const MessagePlan* plan;
+            const char*        data;
+            size_t             size;
+            bool               bytes_slice;
+            bool               enum_names;
+            LazyField          fields[1];
+        };
+
+        const MessagePlan* message_plan(lua_State* L, const Descriptor* descriptor);
+        void               release_plans();
+        EnumPlan*          enum_plan(lua_State* L, const EnumDescriptor* descriptor);
+
+        bool              encode_plan(lua_State* L, int index, const MessagePlan& plan, std::string& out);
+        void              push_plan(lua_State* L, int index, const MessagePlan& plan);
+        int               encode_many(lua_State* L, const MessagePlan& plan, int index, bool split);
+        int               decode_many(lua_State* L, const MessagePlan& plan, int index, const sol::optional<lua_Integer>& i, const sol::optional<lua_Integer>& j);
+        void        decode_plan(lua_State* L, const MessagePlan& plan, const char* data, size_t size, const DecodeOptions& options);
+        void        decode_plan_into(lua_State* L, const MessagePlan& plan, const char* data, size_t size, int index, const DecodeOptions& options);
+        void        decode_options(lua_State* L, int index, int bytes, const MessagePlan& plan, DecodeOptions& options);
+        bool        compile_projection(lua_State* L, int paths, ProjectionNode& root);
+        bool        push_lazy(lua_State* L, const MessagePlan& plan, const char* data, size_t size, int source, int owner, const DecodeOptions& options);
+        void        lazy_field2lua(lua_State* L, const LazyMessage& lazy, size_t slot, int pins);
+        static void lazy_get(lua_State* L, int proxy, int key);
+        static lua_Integer lazy_slot(lua_State* L, const LazyMessage* lazy, int key);
+        void        encode_reflect(lua_State* L, const Message* prototype, int index);
+        void        decode_reflect(lua_State* L, const Message* prototype, const char* data, size_t size);
+
+        template <int TYPE>
+        bool value_lua2wire(lua_State* L, int index, const FieldPlan& field, std::string& out, bool* zero);
+        template <int TYPE>
+        bool value_wire2lua(lua_State* L, const FieldPlan& field, io::CodedInputStream& input);
+        template <int TYPE>
+        void packed_lua2wire(lua_State* L, int array, size_t size, std::string& out);
+        template <int TYPE>
+        bool packed_wire2lua(lua_State* L, int array, lua_Integer* n, const uint8* data, size_t size);
+
+        // t[key] of the table being encoded, raw when its metatable only supplies defaults
+        void encode_field_get(lua_State* L, int index);
+
+        // direct wire format encoder, table at index -> out
+        bool lua2wire(lua_State* L, int index, const MessagePlan& plan, std::string& out);
+        bool sparse_lua2wire(lua_State* L, int index, const MessagePlan& plan, const int* cases, std::string& out, bool* dense);
+        bool oneof_cases_lua(lua_State* L, int index, const MessagePlan& plan, bool raw, int* cases);
+        bool field_lua2wire(lua_State* L, int index, const FieldPlan& field, std::string& out);
+        bool single_field_lua2wire(lua_State* L, int index, const FieldPlan& field, std::string& out);
+        bool repeated_field_lua2wire(lua_State* L, int index, const FieldPlan& field, std::string& out);
+        bool map_field_lua2wire(lua_State* L, int index, const FieldPlan& field, std::string& out);
+
+        // direct wire format decoder, input -> table at index
+        bool wire2lua(lua_State* L, int index, const MessagePlan& plan, io::CodedInputStream& input, DecodeMode mode);
+        bool message_wire2lua(lua_State* L, int index, const MessagePlan& plan, io::CodedInputStream& input, DecodeMode mode);
+        bool nested_wire2lua(lua_State* L, int index, const FieldPlan& field, io::CodedInputStream& input, DecodeMode mode);
+        bool field_wire2lua(lua_State* L, int index, const FieldPlan& field, WireFormatLite::WireType type, io::CodedInputStream& input, FieldState& state, DecodeMode mode);
+        bool single_field_wire2lua(lua_State* L, int index, const FieldPlan& field, io::CodedInputStream& input, DecodeMode mode);
+        bool repeated_field_wire2lua(lua_State* L, int index, const FieldPlan& field, WireFormatLite::WireType type, io::CodedInputStream& input, FieldState& state, DecodeMode mode);
+        bool map_field_wire2lua(lua_State* L, int index, const FieldPlan& field, io::CodedInputStream& input, FieldState& state, DecodeMode mode);
+        bool map_entry_wire2lua(lua_State* L, int map, const FieldPlan& field, uint32 key_tag, uint32 value_tag, io::CodedInputStream& input);
+        void field_table_wire2lua(lua_State* L, int index, const FieldPlan& field, int hint);
+        void count_wire2lua(const MessagePlan& plan, io::CodedInputStream& input, FieldState* state);
+        void default_field2lua(lua_State* L, const FieldPlan& field);
+        void default_message2lua(lua_State* L, const MessagePlan& plan);
+        void defaults_metatable2lua(lua_State* L, const MessagePlan& plan);
+        bool has_defaults_metatable(lua_State* L, int index, const MessagePlan& plan);
+        void unset_fields2lua(lua_State* L, int index, const MessagePlan& plan, const FieldState* state);
+        void oneof_wire2lua(lua_State* L, int index, const MessagePlan& plan, size_t slot, FieldState* state, DecodeMode mode);
+        void oneof_cases2lua(lua_State* L, int index, const MessagePlan& plan, const FieldState* state, DecodeMode mode);
+        int  table_size2lua(const MessagePlan& plan) const;
+
+        // projected decode, fields no path selects are skipped on the wire
+        bool project_wire2lua(lua_State* L, int index, const ProjectionNode& node, io::CodedInputStream& input, DecodeMode mode);
+        bool project_field_wire2lua(lua_State* L, int index, const FieldPlan& field, const ProjectionNode& node, io::CodedInputStream& input, FieldState& state);
+        void project_default2lua(lua_State* L, const FieldPlan& field, const ProjectionNode& node);
+
+        // DECODE_REUSE helpers, tables are emptied in place and keep their array and hash parts
+        void reset_field2lua(lua_State* L, int index, const FieldPlan& field, const FieldState& state);
+        void reset_message2lua(lua_State* L, int index, const MessagePlan& plan);
+        void sweep_message2lua(lua_State* L, int index, const MessagePlan& plan);
+        void trim_array2lua(lua_State* L, int index, lua_Integer size, lua_Integer stale);
+        void clear_table2lua(lua_State* L, int index);
+
         DiskSourceTree*        m_sourceTree;
         Importer*              m_importer;
         DynamicMessageFactory* m_factory;
         sol::reference         m_nil_object;
+
+        std::unordered_map<const Descriptor*, MessagePlan*>  m_plans;
+        std::unordered_map<const EnumDescriptor*, EnumPlan*> m_enums;
+        std::vector<const MessagePlan*>                     m_default_chain;
+
+        std::string m_encode_buffer;  // scratch for Encode, keeps its capacity between calls
+        bool        m_encoding;       // m_encode_buffer in use, a metamethod may encode again
+        bool        m_encode_raw;     // the table lua2wire is on has the defaults metatable
+
+        std::string m_string_scratch;  // string field on its way into a reflection message
+
+        DecodeOptions m_decode;  // options of the wire decode in progress
+
+        ScriptProtobufArena* m_open_arena;     // opened by luapb:arena(), nullptr when none
+        sol::reference       m_open_object;    // keeps the open arena alive
+        char                 m_call_block[kCallArenaBlock];
+        Arena                m_call_arena;     // used when no arena is open, reset after every call
+        Arena*               m_current_arena;  // arena of the reflection call in progress
+        int                  m_arena_depth;    // nested reflection calls, a metamethod may call back in
+    };
+
+    // protobuf arena opened by luapb:arena(), reflection messages are allocated in it until reset
+    class ScriptProtobufArena {
+        friend class ScriptProtobuf;
+
+    public:
+        explicit ScriptProtobufArena(ScriptProtobuf* owner);
+        ScriptProtobufArena(ScriptProtobufArena&& other) = default;
+        ~ScriptProtobufArena();
+
+    public:
+        uint64 Reset();
+        void   Close();
+        uint64 SpaceUsed() const;
+
+        Arena* arena();
+
+    private:
+        ScriptProtobuf*        m_owner;  // nullptr once closed or the owner is gone
+        std::unique_ptr<Arena> m_arena;
+    };
+
+    ScriptProtobufArena::ScriptProtobufArena(ScriptProtobuf* owner)
+        : m_owner(owner)
+        , m_arena(new Arena()) {
+    }
+
+    ScriptProtobufArena::~ScriptProtobufArena() {
+        if (m_owner && m_owner->m_open_arena == this)
+            m_owner->m_open_arena = nullptr;
+    }
+
+    // frees every message allocated since the last reset, returns the bytes released
+    uint64 ScriptProtobufArena::Reset() {
+        if (m_owner && m_owner->m_current_arena == m_arena.get()) {
+            PRINTF("arena reset while a message is in use\n");
+            return 0;
+        }
+        return m_arena->Reset();
+    }
+
+    // routes later calls back to the per call arena
+    void ScriptProtobufArena::Close() {
+        if (m_owner && m_owner->m_current_arena == m_arena.get()) {
+            PRINTF("arena closed while a message is in use\n");
+            return;
+        }
+        if (m_owner && m_owner->m_open_arena == this) {
+            m_owner->m_open_arena = nullptr;
+            m_owner->m_open_object = sol::reference();
+        }
+        m_owner = nullptr;
+        m_arena->Reset();
+    }
+
+    uint64 ScriptProtobufArena::SpaceUsed() const {
+        return m_arena->SpaceUsed();
+    }
+
+    Arena* ScriptProtobufArena::arena() {
+        return m_arena.get();
+    }
+
+    // field paths compiled against one message type by luapb:projection(name, paths)
+    class ScriptProtobufProjection {
+        friend class ScriptProtobuf;
+
+    public:
+        ScriptProtobufProjection(const sol::object& self, const ScriptProtobuf::MessagePlan* plan);
+        ScriptProtobufProjection(ScriptProtobufProjection&& other) = default;
+
+    public:
+        const std::string& Name() const;
+
+    private:
+        sol::reference                 m_self;  // keeps the owning pb object alive, nil for a per call projection
+        ScriptProtobuf::ProjectionNode m_root;
+    };
+
+    ScriptProtobufProjection::ScriptProtobufProjection(const sol::object& self, const ScriptProtobuf::MessagePlan* plan)
+        : m_self(self) {
+        m_root.plan = plan;
+        m_root.whole = false;
+    }
+
+    const std::string& ScriptProtobufProjection::Name() const {
+        return m_root.plan->descriptor->full_name();
+    }
+
+    static ArenaOptions call_arena_options(char* block, size_t size) {
+        ArenaOptions options;
+        options.initial_block = block;
+        options.initial_block_size = size;
+        return options;
+    }
+
+    ScriptProtobuf::ArenaScope::ArenaScope(ScriptProtobuf* owner)
+        : owner(owner) {
+        if (owner->m_arena_depth++ == 0)
+            owner->m_current_arena = owner->m_open_arena ? owner->m_open_arena->arena() : &owner->m_call_arena;
+        arena = owner->m_current_arena;
+    }
+
+    ScriptProtobuf::ArenaScope::~ArenaScope() {
+        if (--owner->m_arena_depth == 0) {
+            if (owner->m_current_arena == &owner->m_call_arena)
+                owner->m_call_arena.Reset();
+            owner->m_current_arena = nullptr;
+        }
+    }
+
+    // body runs with the arguments of the call; on a lua error the state is put back as it was on entry,
+    // the call arena of an outermost call is reset, then the error goes on to the caller
+    int ScriptProtobuf::protected_call(lua_State* L, lua_CFunction body) {
+        CallState saved = { m_arena_depth, m_current_arena, m_encoding, m_encode_raw, m_decode, m_default_chain.size() };
+        lua_pushcfunction(L, body);
+        lua_insert(L, 1);
+        if (lua_pcall(L, lua_gettop(L) - 1, LUA_MULTRET, 0) == LUA_OK)
+            return lua_gettop(L);
+
+        if (saved.arena_depth == 0 && m_current_arena == &m_call_arena)
+            m_call_arena.Reset();
+        m_arena_depth = saved.arena_depth;
+        m_current_arena = saved.current_arena;
+        m_encoding = saved.encoding;
+        m_encode_raw = saved.encode_raw;
+        m_decode = saved.decode;
+        m_default_chain.resize(saved.default_chain);
+        return lua_error(L);
+    }
+
+    ScriptProtobuf* ScriptProtobuf::Owner(lua_State* L) {
+        return lua_checkself<ScriptProtobuf>(L);
+    }
+
+    ScriptProtobuf* ScriptProtobuf::LazyOwner(lua_State* L) {
+        return static_cast<LazyMessage*>(luaL_checkudata(L, 1, kLazyMetatable))->owner;
+    }
+
+    // message type resolved once by luapb:type(name), no type name lookup per call
+    class ScriptProtobufType {
+    public:
+        ScriptProtobufType(ScriptProtobuf* owner, const sol::object& self, const Descriptor* descriptor,
+            const ScriptProtobuf::MessagePlan* plan, const Message* prototype);
+
+    public:
+        // hot path, raw lua_CFunction bindings
+        static int Encode(lua_State* L);      // type:encode(tab)
+        static int Decode(lua_State* L);      // type:decode(bytes [, i [, j]] [, options])
+        static int DecodeInto(lua_State* L);  // type:decode_into(bytes, tab [, i [, j]] [, options])
+        static int DecodeLazy(lua_State* L);  // type:decode_lazy(bytes [, i [, j]] [, options])
+        static int EncodeMany(lua_State* L);  // type:encode_many(array [, split])
+        static int DecodeMany(lua_State* L);  // type:decode_many(msgs [, i [, j]])
+        static int EncodeReflect(lua_State* L);  // type:encode_reflect(tab)
+        static int DecodeReflect(lua_State* L);  // type:decode_reflect(bytes [, i [, j]])
+
+        static ScriptProtobuf* Owner(lua_State* L);  // pb of the self argument, for ScriptProtobuf::Guard
+
+    public:
+        size_t             EncodeTo(ScriptProtobufBuffer& buffer, const sol::table& tab);
+        const std::string& Name() const;
+
+    private:
+        ScriptProtobuf*                    m_owner;
+        sol::reference                     m_self;  // keeps the owning pb object alive
+        const Descriptor*                  m_descriptor;
+        const ScriptProtobuf::MessagePlan* m_plan;
+        const Message*                     m_prototype;
     };
 
+    ScriptProtobufType::ScriptProtobufType(ScriptProtobuf* owner, const sol::object& self, const Descriptor* descriptor,
+        const ScriptProtobuf::MessagePlan* plan, const Message* prototype)
+        : m_owner(owner)
+        , m_self(self)
+        , m_descriptor(descriptor)
+        , m_plan(plan)
+        , m_prototype(prototype) {
+    }
+
+    int ScriptProtobufType::Encode(lua_State* L) {
+        ScriptProtobufType* self = lua_checkself<ScriptProtobufType>(L);
+        luaL_checktype(L, 2, LUA_TTABLE);
+        self->m_owner->push_plan(L, 2, *self->m_plan);
+        return 1;
+    }
+
+    int ScriptProtobufType::Decode(lua_State* L) {
+        ScriptProtobufType*                 self = lua_checkself<ScriptProtobufType>(L);
+        sol::optional<lua_Integer>          i, j;
+        int                                 opts = lua_rangeargs(L, 3, &i, &j);
+        const char*                         data = nullptr;
+        size_t                              size = 0;
+        ScriptProtobuf::DecodeOptions       options;
+        lua_checkbytes(L, 2, i, j, &data, &size);
+        self->m_owner->decode_options(L, opts, 2, *self->m_plan, options);
+        self->m_owner->decode_plan(L, *self->m_plan, data, size, options);
+        return 1;
+    }
+
+    int ScriptProtobufType::DecodeInto(lua_State* L) {
+        ScriptProtobufType* self = lua_checkself<ScriptProtobufType>(L);
+        luaL_checktype(L, 3, LUA_TTABLE);
+        sol::optional<lua_Integer>    i, j;
+        int                           opts = lua_rangeargs(L, 4, &i, &j);
+        const char*                   data = nullptr;
+        size_t                        size = 0;
+        ScriptProtobuf::DecodeOptions options;
+        lua_checkbytes(L, 2, i, j, &data, &size);
+        self->m_owner->decode_options(L, opts, 2, *self->m_plan, options);
+        self->m_owner->decode_plan_into(L, *self->m_plan, data, size, 3, options);
+        lua_pushvalue(L, 3);
+        return 1;
+    }
+
+    int ScriptProtobufType::DecodeLazy(lua_State* L) {
+        ScriptProtobufType*           self = lua_checkself<ScriptProtobufType>(L);
+        sol::optional<lua_Integer>    i, j;
+        int                           opts = lua_rangeargs(L, 3, &i, &j);
+        const char*                   data = nullptr;
+        size_t                        size = 0;
+        ScriptProtobuf::DecodeOptions options;
+        lua_checkbytes(L, 2, i, j, &data, &size);
+        self->m_owner->decode_options(L, opts, 2, *self->m_plan, options);
+        int source = options.bytes_slice ? options.source : lua_pushsource(L, 2);
+        self->m_self.push(L);
+        if (!self->m_owner->push_lazy(L, *self->m_plan, data, size, source, lua_gettop(L), options)) {
+            PRINTF("decode_pb(): parse failed. name = %s\n", self->Name().c_str());
+            lua_newtable(L);
+        }
+        return 1;
+    }
+
+    size_t ScriptProtobufType::EncodeTo(ScriptProtobufBuffer& buffer, const sol::table& tab) {
+        lua_State* L = tab.lua_state();
+        size_t     start = buffer.storage().size();
+        tab.push();
+        m_owner->encode_plan(L, lua_gettop(L), *m_plan, buffer.storage());
+        lua_pop(L, 1);
+        return buffer.storage().size() - start;
+    }
+
+    int ScriptProtobufType::EncodeMany(lua_State* L) {
+        ScriptProtobufType* self = lua_checkself<ScriptProtobufType>(L);
+        return self->m_owner->encode_many(L, *self->m_plan, 2, lua_toboolean(L, 3) != 0);
+    }
+
+    int ScriptProtobufType::DecodeMany(lua_State* L) {
+        ScriptProtobufType*        self = lua_checkself<ScriptProtobufType>(L);
+        sol::optional<lua_Integer> i, j;
+        lua_rangeargs(L, 3, &i, &j);
+        return self->m_owner->decode_many(L, *self->m_plan, 2, i, j);
+    }
+
+    int ScriptProtobufType::EncodeReflect(lua_State* L) {
+        ScriptProtobufType* self = lua_checkself<ScriptProtobufType>(L);
+        luaL_checktype(L, 2, LUA_TTABLE);
+        self->m_owner->encode_reflect(L, self->m_prototype, 2);
+        return 1;
+    }
+
+    int ScriptProtobufType::DecodeReflect(lua_State* L) {
+        ScriptProtobufType*        self = lua_checkself<ScriptProtobufType>(L);
+        sol::optional<lua_Integer> i, j;
+        lua_rangeargs(L, 3, &i, &j);
+        const char* data = nullptr;
+        size_t      size = 0;
+        lua_checkbytes(L, 2, i, j, &data, &size);
+        self->m_owner->decode_reflect(L, self->m_prototype, data, size);
+        return 1;
+    }
+
+    ScriptProtobuf* ScriptProtobufType::Owner(lua_State* L) {
+        return lua_checkself<ScriptProtobufType>(L)->m_owner;
+    }
+
+    const std::string& ScriptProtobufType::Name() const {
+        return m_descriptor->full_name();
+    }
+
     ScriptProtobuf::ScriptProtobuf(sol::this_state L, const std::string& file)
         : m_sourceTree(new DiskSourceTree())
         , m_importer(nullptr)
         , m_factory(nullptr)
-        , m_nil_object(L, sol::lua_nil) {
+        , m_nil_object(L, sol::lua_nil)
+        , m_encoding(false)
+        , m_encode_raw(false)
+        , m_open_arena(nullptr)
+        , m_call_arena(call_arena_options(m_call_block, sizeof(m_call_block)))
+        , m_current_arena(nullptr)
+        , m_arena_depth(0) {
+        // resolve proto files relative to the working directory, absolute paths as is
+        m_sourceTree->MapPath("", "");
         if (!load_proto_file(file))
             PRINTF("new ScriptProtobuf Error\n");
     }
 
     ScriptProtobuf::~ScriptProtobuf() {
+        if (m_open_arena)
+            m_open_arena->m_owner = nullptr;
+        release_plans();
         SAFE_RELEASE(m_factory);
         SAFE_RELEASE(m_importer);
         SAFE_RELEASE(m_sourceTree);
     }
 
-    Message* ScriptProtobuf::create_message(const std::string& typeName) {
+    Message* ScriptProtobuf::create_message(const std::string& typeName, Arena* arena) {
         Message* message = nullptr;
         if (m_importer) {
             const Descriptor* descriptor = m_importer->pool()->FindMessageTypeByName(typeName);
             if (descriptor) {
                 const Message* prototype = m_factory->GetPrototype(descriptor);
                 if (prototype) {
-                    message = prototype->New();
+                    message = prototype->New(arena);
                 }
             }
             else {
@@ -130,7 +1019,7 @@ namespace lua_module {
                     const Message* prototype =
                         MessageFactory::generated_factory()->GetPrototype(descriptor);
                     if (prototype) {
-                        message = prototype->New();
+                        message = prototype->New(arena);
                     }
                 }
             }
@@ -142,28 +1031,77 @@ namespace lua_module {
                 const Message* prototype =
                     MessageFactory::generated_factory()->GetPrototype(descriptor);
                 if (prototype) {
-                    message = prototype->New();
+                    message = prototype->New(arena);
                 }
             }
         }
         return message;
     }
 
-    const EnumDescriptor* ScriptProtobuf::find_enum_descriptor(const std::string& enumName) {
+    // arena messages are freed by the arena reset
+    void ScriptProtobuf::release_message(Message* message, Arena* arena) {
+        if (!arena)
+            delete message;
+    }
+
+    const Descriptor* ScriptProtobuf::find_message_descriptor(const std::string& typeName) {
         if (m_importer) {
-            const EnumDescriptor* descriptor = m_importer->pool()->FindEnumTypeByName(enumName);
+            const Descriptor* descriptor = m_importer->pool()->FindMessageTypeByName(typeName);
 
             if (descriptor)
                 return descriptor;
-            else {
-                const EnumDescriptor* descriptor =
-                    DescriptorPool::generated_pool()->FindEnumTypeByName(enumName);
-                return descriptor;
-            }
         }
-        else {
-            const EnumDescriptor* descriptor = DescriptorPool::generated_pool()->FindEnumTypeByName(enumName);
-            return descriptor;
+        return DescriptorPool::generated_pool()->FindMessageTypeByName(typeName);
+    }
+
+    const Message* ScriptProtobuf::find_prototype(const Descriptor* descriptor) {
+        if (descriptor->file()->pool() == DescriptorPool::generated_pool())
+            return MessageFactory::generated_factory()->GetPrototype(descriptor);
+        return m_factory->GetPrototype(descriptor);
+    }
+
+    sol::object ScriptProtobuf::Type(sol::object self, const char* structName, sol::this_state s) {
+        ScriptProtobuf&   pb = self.as<ScriptProtobuf&>();
+        const Descriptor* descriptor = pb.find_message_descriptor(structName);
+        const Message*    prototype = descriptor ? pb.find_prototype(descriptor) : nullptr;
+        if (!prototype) {
+            PRINTF("cant find message  %s source compiled poll \n", structName);
+            return sol::make_object(s, sol::lua_nil);
+        }
+        return sol::make_object(s, ScriptProtobufType(&pb, self, descriptor, pb.message_plan(s, descriptor), prototype));
+    }
+
+    // opens a new arena for this pb, closing the one open before
+    sol::object ScriptProtobuf::OpenArena(sol::object self, sol::this_state s) {
+        ScriptProtobuf& pb = self.as<ScriptProtobuf&>();
+        if (pb.m_arena_depth > 0) {
+            PRINTF("arena opened while a message is in use\n");
+            return sol::make_object(s, sol::lua_nil);
+        }
+        if (pb.m_open_arena)
+            pb.m_open_arena->Close();
+
+        sol::object object = sol::make_object(s, ScriptProtobufArena(&pb));
+        pb.m_open_arena = &object.as<ScriptProtobufArena&>();
+        pb.m_open_object = object;
+        return object;
+    }
+
+    const EnumDescriptor* ScriptProtobuf::find_enum_descriptor(const std::string& enumName) {
+        if (m_importer) {
+            const EnumDescriptor* descriptor = m_importer->pool()->FindEnumTypeByName(enumName);
+
+            if (descriptor)
+                return descriptor;
+            else {
+                const EnumDescriptor* descriptor =
+                    DescriptorPool::generated_pool()->FindEnumTypeByName(enumName);
+                return descriptor;
+            }
+        }
+        else {
+            const EnumDescriptor* descriptor = DescriptorPool::generated_pool()->FindEnumTypeByName(enumName);
+            return descriptor;
         }
     }
 
@@ -186,6 +1124,7 @@ namespace lua_module {
         m_sourceTree->MapPath("", strProtoPath);
         m_sourceTree->MapPath("", strProtoPath2);
  */
+        release_plans();
         SAFE_RELEASE(m_factory);
         SAFE_RELEASE(m_importer);
 
@@ -208,148 +1147,938 @@ namespace lua_module {
         return load_root_proto(sfile);
     }
 
-    sol::table ScriptProtobuf::Decode(const char* structName, const std::string& msg) {
-        sol::state_view lua(m_nil_object.lua_state());
-        sol::table      root = lua.create_table();
+    int ScriptProtobuf::Decode(lua_State* L) {
+        ScriptProtobuf* self = lua_checkself<ScriptProtobuf>(L);
+        const char*     structName = luaL_checkstring(L, 2);
+
+        const Descriptor* descriptor = self->find_message_descriptor(structName);
+        if (!descriptor) {
+            PRINTF("decode_pb(): failed to create pb message. name = %s\n", structName);
+            lua_newtable(L);
+            return 1;
+        }
+        sol::optional<lua_Integer> i, j;
+        int                        opts = lua_rangeargs(L, 4, &i, &j);
+        const char*                data = nullptr;
+        size_t                     size = 0;
+        DecodeOptions              options;
+        lua_checkbytes(L, 3, i, j, &data, &size);
+        const MessagePlan* plan = self->message_plan(L, descriptor);
+        self->decode_options(L, opts, 3, *plan, options);
+        self->decode_plan(L, *plan, data, size, options);
+        return 1;
+    }
 
-        Message* pbMsg = create_message(structName);
+    // pushes the decoded table, an empty one on failure
+    void ScriptProtobuf::decode_plan(lua_State* L, const MessagePlan& plan, const char* data, size_t size, const DecodeOptions& options) {
+        int                  top = lua_gettop(L);
+        io::CodedInputStream input(reinterpret_cast<const uint8*>(data), static_cast<int>(size));
 
-        if (pbMsg) {
-            if (pbMsg->ParseFromString(msg))
-                protobuf2lua(*pbMsg, root);
-            else
-                PRINTF("decode_pb(): parse failed. name = %s\n", structName);
-            delete pbMsg;
+        // a finalizer run by the allocator may decode again
+        DecodeOptions saved = m_decode;
+        m_decode = options;
+        lua_createtable(L, 0, table_size2lua(plan));
+        bool ok = options.fields ? project_wire2lua(L, top + 1, *options.fields, input, DECODE_NEW) : wire2lua(L, top + 1, plan, input, DECODE_NEW);
+        if (!ok || !input.ConsumedEntireMessage()) {
+            PRINTF("decode_pb(): parse failed. name = %s\n", plan.descriptor->full_name().c_str());
+            lua_settop(L, top);
+            lua_newtable(L);
         }
-        else
-            PRINTF("decode_pb(): failed to create pb message. name = %s\n", structName);
+        lua_settop(L, top + 1);
+        m_decode = saved;
+    }
+
+    ScriptProtobuf::DecodeOptions::DecodeOptions()
+        : bytes_slice(false)
+        , source(0)
+        , fields(nullptr)
+        , defaults(DEFAULTS_FILL)
+        , oneof_case(false)
+        , enum_names(false) {
+    }
+
+    // reads the options table at index, bytes is the stack index of the encoded message;
+    // what the options point to is left on the stack for the rest of the call
+    void ScriptProtobuf::decode_options(lua_State* L, int index, int bytes, const MessagePlan& plan, DecodeOptions& options) {
+        if (!index)
+            return;
+
+        lua_getfield(L, index, "fields");
+        if (lua_type(L, -1) == LUA_TTABLE) {
+            // a list of paths is compiled for this call only, luapb:projection compiles it once
+            int paths = lua_gettop(L);
+            sol::stack::push(L, ScriptProtobufProjection(sol::object(), &plan));
+            ScriptProtobufProjection* projection = sol::stack::get<ScriptProtobufProjection*>(L, -1);
+            compile_projection(L, paths, projection->m_root);
+            options.fields = &projection->m_root;
+            lua_remove(L, paths);
+        }
+        else {
+            ScriptProtobufProjection* projection = lua_testobject<ScriptProtobufProjection>(L, -1);
+            if (projection && projection->m_root.plan != &plan)
+                PRINTF("decode_pb(): projection of %s ignored. name = %s\n", projection->Name().c_str(), plan.descriptor->full_name().c_str());
+            else if (projection)
+                options.fields = &projection->m_root;
+            else if (!lua_isnil(L, -1))
+                PRINTF("decode_pb(): fields must be a list of paths or a projection. name = %s\n", plan.descriptor->full_name().c_str());
+            lua_pop(L, 1);
+        }
+
+        lua_getfield(L, index, "defaults");
+        const char* defaults = lua_tostring(L, -1);
+        if (defaults && strcmp(defaults, "omit") == 0)
+            options.defaults = DEFAULTS_OMIT;
+        else if (defaults && strcmp(defaults, "metatable") == 0)
+            options.defaults = DEFAULTS_METATABLE;
+        else if (defaults && strcmp(defaults, "fill") != 0)
+            PRINTF("decode_pb(): unknown defaults mode %s\n", defaults);
+        lua_pop(L, 1);
+
+        lua_getfield(L, index, "oneof_case");
+        options.oneof_case = lua_toboolean(L, -1) != 0;
+        lua_pop(L, 1);
 
-        return root;
+        lua_getfield(L, index, "enums");
+        const char* enums = lua_tostring(L, -1);
+        if (enums && strcmp(enums, "name") == 0)
+            options.enum_names = true;
+        else if (enums && strcmp(enums, "number") != 0)
+            PRINTF("decode_pb(): unknown enums mode %s\n", enums);
+        lua_pop(L, 1);
+
+        lua_getfield(L, index, "bytes");
+        const char* mode = lua_tostring(L, -1);
+        if (mode && strcmp(mode, "slice") == 0)
+            options.bytes_slice = true;
+        else if (mode && strcmp(mode, "string") != 0)
+            PRINTF("decode_pb(): unknown bytes mode %s\n", mode);
+        lua_pop(L, 1);
+
+        // slices of a slice pin the string under it
+        if (options.bytes_slice)
+            options.source = lua_pushsource(L, bytes);
     }
-    sol::table ScriptProtobuf::GetEnum(const char* structName) {
-        sol::state_view lua(m_nil_object.lua_state());
-        sol::table      root = lua.create_table();
-        auto            descriptor = find_enum_descriptor(structName);
-        if (descriptor) {
-            for (int i = 0; i < descriptor->value_count(); i++) {
-                auto desc = descriptor->value(i);
-                root[desc->name()] = desc->number();
+
+    // "a.b.c" paths -> a node per partly selected message; a path that ends at a field, or reaches a map, selects it whole
+    bool ScriptProtobuf::compile_projection(lua_State* L, int paths, ProjectionNode& root) {
+        bool   ok = true;
+        size_t count = lua_rawlen(L, paths);
+        for (size_t i = 1; i <= count; ++i) {
+            lua_rawgeti(L, paths, static_cast<lua_Integer>(i));
+            size_t      len = 0;
+            const char* path = lua_type(L, -1) == LUA_TSTRING ? lua_tolstring(L, -1, &len) : nullptr;
+            if (!path) {
+                PRINTF("projection: path %d is not a string\n", static_cast<int>(i));
+                ok = false;
+                lua_pop(L, 1);
+                continue;
+            }
+
+            ProjectionNode* node = &root;
+            const char*     at = path;
+            const char*     end = path + len;
+            while (!node->whole) {
+                const char* dot = static_cast<const char*>(memchr(at, '.', end - at));
+                const char* stop = dot ? dot : end;
+                lua_rawgeti(L, LUA_REGISTRYINDEX, node->plan->names);
+                lua_pushlstring(L, at, stop - at);
+                lua_rawget(L, -2);
+                lua_Integer slot = lua_tointeger(L, -1);
+                lua_pop(L, 2);
+                if (slot == 0) {
+                    PRINTF("projection: no field %.*s in %s, path %s\n", static_cast<int>(stop - at), at, node->plan->descriptor->full_name().c_str(), path);
+                    ok = false;
+                    break;
+                }
+
+                const FieldPlan& field = node->plan->fields[slot - 1];
+                if (dot && !field.message) {
+                    PRINTF("projection: %s is not a message, path %s\n", field.fd->full_name().c_str(), path);
+                    ok = false;
+                    break;
+                }
+                if (node->slots.empty())
+                    node->slots.resize(node->plan->fields.size());
+                std::unique_ptr<ProjectionNode>& child = node->slots[slot - 1];
+                if (!child) {
+                    child.reset(new ProjectionNode());
+                    child->plan = field.message;
+                    child->whole = false;
+                }
+                if (!dot || field.kind == FIELD_MAP) {
+                    child->whole = true;
+                    child->slots.clear();
+                    break;
+                }
+                node = child.get();
+                at = dot + 1;
             }
+            lua_pop(L, 1);
         }
-        else
+        return ok;
+    }
+
+    // paths compiled once, for the fields option of decode
+    sol::object ScriptProtobuf::Projection(sol::object self, const char* structName, sol::table paths, sol::this_state s) {
+        ScriptProtobuf&   pb = self.as<ScriptProtobuf&>();
+        const Descriptor* descriptor = pb.find_message_descriptor(structName);
+        if (!descriptor) {
             PRINTF("cant find message  %s source compiled poll \n", structName);
+            return sol::make_object(s, sol::lua_nil);
+        }
+        sol::object object = sol::make_object(s, ScriptProtobufProjection(self, pb.message_plan(s, descriptor)));
+        paths.push();
+        bool ok = pb.compile_projection(s, lua_gettop(s), object.as<ScriptProtobufProjection&>().m_root);
+        lua_pop(s, 1);
+        if (!ok)
+            return sol::make_object(s, sol::lua_nil);
+        return object;
+    }
+
+    // decodes into a caller supplied table, a parse failure leaves it empty
+    int ScriptProtobuf::DecodeInto(lua_State* L) {
+        ScriptProtobuf* self = lua_checkself<ScriptProtobuf>(L);
+        const char*     structName = luaL_checkstring(L, 2);
+        luaL_checktype(L, 4, LUA_TTABLE);
 
-        return root;
+        sol::optional<lua_Integer> i, j;
+        int                        opts = lua_rangeargs(L, 5, &i, &j);
+        const Descriptor*          descriptor = self->find_message_descriptor(structName);
+        const char*                data = nullptr;
+        size_t                     size = 0;
+        DecodeOptions              options;
+        lua_checkbytes(L, 3, i, j, &data, &size);
+        if (!descriptor)
+            PRINTF("decode_pb(): failed to create pb message. name = %s\n", structName);
+        else {
+            const MessagePlan* plan = self->message_plan(L, descriptor);
+            self->decode_options(L, opts, 3, *plan, options);
+            self->decode_plan_into(L, *plan, data, size, 4, options);
+        }
+        lua_pushvalue(L, 4);
+        return 1;
     }
 
-    sol::table ScriptProtobuf::GetStruct(const char* structName) {
-        sol::state_view lua(m_nil_object.lua_state());
-        sol::table      root = lua.create_table();
-        Message*        pbMsg = create_message(structName);
-        if (pbMsg) {
-            auto descriptor = pbMsg->GetDescriptor();
+    void ScriptProtobuf::decode_plan_into(lua_State* L, const MessagePlan& plan, const char* data, size_t size, int index, const DecodeOptions& options) {
+        int                  top = lua_gettop(L);
+        io::CodedInputStream input(reinterpret_cast<const uint8*>(data), static_cast<int>(size));
 
-            if (descriptor) {
-                for (int i = 0; i < descriptor->field_count(); i++) {
-                    auto desc = descriptor->field(i);
+        DecodeOptions saved = m_decode;
+        m_decode = options;
+        // a projection fills the emptied table as decode would a new one
+        if (options.fields)
+            clear_table2lua(L, index);
+        bool ok = options.fields ? project_wire2lua(L, index, *options.fields, input, DECODE_NEW) : wire2lua(L, index, plan, input, DECODE_REUSE);
+        if (!ok || !input.ConsumedEntireMessage()) {
+            PRINTF("decode_pb(): parse failed. name = %s\n", plan.descriptor->full_name().c_str());
+            lua_settop(L, top);
+            clear_table2lua(L, index);
+        }
+        lua_settop(L, top);
+        m_decode = saved;
+    }
 
-                    if (desc->is_repeated()) {
-                        root[desc->name()] = lua.create_table();
-                    }
-                    else {
-                        switch (desc->cpp_type()) {
-                        case FieldDescriptor::CPPTYPE_INT32: {
-                            auto value = desc->has_default_value() ? desc->default_value_int32() : 0;
-                            root[desc->name()] = value;
-                            break;
-                        }
-                        case FieldDescriptor::CPPTYPE_INT64: {
-                            auto value = desc->has_default_value() ? desc->default_value_int64() : 0;
-                            root[desc->name()] = value;
-                            break;
-                        }
-                        case FieldDescriptor::CPPTYPE_UINT32: {
-                            auto value = desc->has_default_value() ? desc->default_value_uint32() : 0;
-                            root[desc->name()] = value;
-                            break;
-                        }
-                        case FieldDescriptor::CPPTYPE_UINT64: {
-                            auto value = desc->has_default_value() ? desc->default_value_uint64() : 0;
-                            root[desc->name()] = value;
-                            break;
-                        }
-                        case FieldDescriptor::CPPTYPE_DOUBLE: {
-                            auto value = desc->has_default_value() ? desc->default_value_double() : 0.0;
-                            root[desc->name()] = value;
-                            break;
-                        }
-                        case FieldDescriptor::CPPTYPE_FLOAT: {
-                            auto value = desc->has_default_value() ? desc->default_value_float() : 0.0;
-                            root[desc->name()] = value;
-                            break;
-                        }
-                        case FieldDescriptor::CPPTYPE_BOOL: {
-                            auto value = desc->has_default_value() ? desc->default_value_bool() : 0;
-                            root[desc->name()] = value;
-                            break;
-                        }
-                        case FieldDescriptor::CPPTYPE_ENUM: {
-                            auto value = desc->has_default_value() ? desc->default_value_enum() : 0;
-                            root[desc->name()] = value;
-                            break;
-                        }
-                        case FieldDescriptor::CPPTYPE_STRING: {
-                            auto value = desc->has_default_value() ? desc->default_value_string() : "";
-                            root[desc->name()] = value;
-                            break;
-                        }
-                        case FieldDescriptor::CPPTYPE_MESSAGE: {
-                            auto prototype = m_factory->GetPrototype(desc->message_type());
-                            if (prototype) {
-                                auto sname = prototype->GetTypeName().c_str();
-                                root[desc->name()] = GetStruct(sname);
-                            }
-                            else {
-                                root[desc->name()] = lua.create_table();
-                            }
-                            break;
-                        }
-                        default:
-                            root[desc->name()] = 0;
-                            break;
-                        }
+    // a proxy over the encoded message, fields are decoded on first access
+    int ScriptProtobuf::DecodeLazy(lua_State* L) {
+        ScriptProtobuf* self = lua_checkself<ScriptProtobuf>(L);
+        const char*     structName = luaL_checkstring(L, 2);
+
+        const Descriptor* descriptor = self->find_message_descriptor(structName);
+        if (!descriptor) {
+            PRINTF("decode_pb(): failed to create pb message. name = %s\n", structName);
+            lua_newtable(L);
+            return 1;
+        }
+        sol::optional<lua_Integer> i, j;
+        int                        opts = lua_rangeargs(L, 4, &i, &j);
+        const char*                data = nullptr;
+        size_t                     size = 0;
+        DecodeOptions              options;
+        lua_checkbytes(L, 3, i, j, &data, &size);
+        const MessagePlan* plan = self->message_plan(L, descriptor);
+        self->decode_options(L, opts, 3, *plan, options);
+        int source = options.bytes_slice ? options.source : lua_pushsource(L, 3);
+        if (!self->push_lazy(L, *plan, data, size, source, 1, options)) {
+            PRINTF("decode_pb(): parse failed. name = %s\n", structName);
+            lua_newtable(L);
+        }
+        return 1;
+    }
+
+    // one pass over the top level tags records where each field is, nothing is decoded;
+    // source and owner are the stack indices of the string that holds data and of the pb object
+    bool ScriptProtobuf::push_lazy(lua_State* L, const MessagePlan& plan, const char* data, size_t size, int source, int owner, const DecodeOptions& options) {
+        size_t       count = plan.fields.size();
+        LazyMessage* lazy = static_cast<LazyMessage*>(lua_newuserdata(L, sizeof(LazyMessage) + sizeof(LazyField) * (count ? count - 1 : 0)));
+        lazy->owner = this;
+        lazy->plan = &plan;
+        lazy->data = data;
+        lazy->size = size;
+        lazy->bytes_slice = options.bytes_slice;
+        lazy->enum_names = options.enum_names;
+        memset(lazy->fields, 0, sizeof(LazyField) * count);
+
+        io::CodedInputStream scan(reinterpret_cast<const uint8*>(data), static_cast<int>(size));
+        for (;;) {
+            uint32 position = static_cast<uint32>(scan.CurrentPosition());
+            uint32 tag = scan.ReadTag();
+            if (tag == 0)
+                break;
+
+            WireFormatLite::WireType type = WireFormatLite::GetTagWireType(tag);
+            const FieldPlan*         field = plan.find(WireFormatLite::GetTagFieldNumber(tag));
+            if (field && (type == field->wire_type || (field->packable && type == WireFormatLite::WIRETYPE_LENGTH_DELIMITED))) {
+                LazyField& at = lazy->fields[field - plan.fields.data()];
+                // a later oneof member replaces the earlier ones
+                if (field->oneof >= 0) {
+                    for (int other : plan.oneofs[field->oneof].slots) {
+                        if (&lazy->fields[other] != &at)
+                            lazy->fields[other].count = 0;
                     }
                 }
+                if (!at.count)
+                    at.first = position;
+                at.last = position;
+                at.count++;
+            }
+            if (!WireFormatLite::SkipField(&scan, tag)) {
+                lua_pop(L, 1);
+                return false;
+            }
+        }
+        if (!scan.ConsumedEntireMessage()) {
+            lua_pop(L, 1);
+            return false;
+        }
+
+        luaL_setmetatable(L, kLazyMetatable);
+        lua_createtable(L, 3, 0);
+        lua_pushvalue(L, source);
+        lua_rawseti(L, -2, 1);
+        lua_pushvalue(L, owner);
+        lua_rawseti(L, -2, 2);
+        lua_newtable(L);
+        lua_rawseti(L, -2, 3);
+        lua_setuservalue(L, -2);
+        return true;
+    }
+
+    // pushes the value of one field of a lazy message, nil if its bytes do not parse;
+    // a sub-message seen once and the elements of a repeated message stay lazy, a group is decoded as it has no length
+    void ScriptProtobuf::lazy_field2lua(lua_State* L, const LazyMessage& lazy, size_t slot, int pins) {
+        const FieldPlan& field = lazy.plan->fields[slot];
+        const LazyField& at = lazy.fields[slot];
+        int              top = lua_gettop(L);
+        int              source = top + 1;
+        lua_rawgeti(L, pins, 1);
+
+        DecodeOptions saved = m_decode;
+        m_decode = DecodeOptions();
+        m_decode.bytes_slice = lazy.bytes_slice;
+        m_decode.enum_names = lazy.enum_names;
+        m_decode.source = source;
+
+        if (!at.count) {
+            if (field.oneof >= 0)
+                lua_pushnil(L);
+            else
+                default_field2lua(L, field);
+            lua_replace(L, source);
+            m_decode = saved;
+            return;
+        }
+
+        io::CodedInputStream input(reinterpret_cast<const uint8*>(lazy.data + at.first), static_cast<int>(lazy.size - at.first));
+        uint32               end = at.last - at.first;
+        bool                 ok = true;
+        if (field.message && field.wire_type == WireFormatLite::WIRETYPE_LENGTH_DELIMITED && field.kind != FIELD_MAP && (field.kind == FIELD_REPEATED || at.count == 1)) {
+            lua_rawgeti(L, pins, 2);
+            int         owner = top + 2;
+            int         array = 0;
+            lua_Integer n = 0;
+            if (field.kind == FIELD_REPEATED) {
+                lua_createtable(L, static_cast<int>(at.count), 0);
+                array = lua_gettop(L);
+            }
+            while (ok && static_cast<uint32>(input.CurrentPosition()) <= end) {
+                uint32 tag = input.ReadTag();
+                if (tag == 0)
+                    break;
+                if (WireFormatLite::GetTagFieldNumber(tag) != field.fd->number()
+                    || WireFormatLite::GetTagWireType(tag) != WireFormatLite::WIRETYPE_LENGTH_DELIMITED) {
+                    ok = WireFormatLite::SkipField(&input, tag);
+                    continue;
+                }
+                uint32      len = 0;
+                const void* data = lazy.data;
+                int         size = 0;
+                if (!input.ReadVarint32(&len))
+                    ok = false;
+                else if (len > 0 && (!input.GetDirectBufferPointer(&data, &size) || static_cast<uint32>(size) < len))
+                    ok = false;
+                else if (!push_lazy(L, *field.message, static_cast<const char*>(data), len, source, owner, m_decode))
+                    ok = false;
+                else {
+                    input.Skip(static_cast<int>(len));
+                    if (array)
+                        lua_rawseti(L, array, ++n);
+                }
+            }
+        }
+        else {
+            // everything else decodes its occurrences as wire2lua would, into a scratch table
+            lua_newtable(L);
+            int        scratch = lua_gettop(L);
+            FieldState state = { false, static_cast<int>(at.count), -1, 0 };
+            while (ok && static_cast<uint32>(input.CurrentPosition()) <= end) {
+                uint32 tag = input.ReadTag();
+                if (tag == 0)
+                    break;
+                WireFormatLite::WireType type = WireFormatLite::GetTagWireType(tag);
+                if (WireFormatLite::GetTagFieldNumber(tag) != field.fd->number()
+                    || (type != field.wire_type && !(field.packable && type == WireFormatLite::WIRETYPE_LENGTH_DELIMITED))) {
+                    ok = WireFormatLite::SkipField(&input, tag);
+                    continue;
+                }
+                ok = field_wire2lua(L, scratch, field, type, input, state, DECODE_NEW);
+                state.seen = true;
+            }
+            lua_rawgeti(L, LUA_REGISTRYINDEX, field.key);
+            lua_rawget(L, scratch);
+        }
+
+        if (!ok) {
+            PRINTF("decode_pb(): parse failed. name = %s\n", field.fd->full_name().c_str());
+            lua_settop(L, top);
+            lua_pushnil(L);
+        }
+        else {
+            lua_replace(L, source);
+            lua_settop(L, source);
+        }
+        m_decode = saved;
+    }
+
+    // proxy[key] through the cache, a field name not cached yet is decoded and cached
+    void ScriptProtobuf::lazy_get(lua_State* L, int proxy, int key) {
+        LazyMessage* lazy = static_cast<LazyMessage*>(lua_touserdata(L, proxy));
+        lua_getuservalue(L, proxy);
+        int pins = lua_gettop(L);
+        lua_rawgeti(L, pins, 3);
+        int cache = pins + 1;
+        lua_pushvalue(L, key);
+        lua_rawget(L, cache);
+        if (lua_touserdata(L, -1) == &kLazyTombstone) {
+            lua_pop(L, 1);
+            lua_pushnil(L);
+        }
+        else if (lua_isnil(L, -1) && lua_type(L, key) == LUA_TSTRING) {
+            lua_pop(L, 1);
+            lua_rawgeti(L, LUA_REGISTRYINDEX, lazy->plan->names);
+            lua_pushvalue(L, key);
+            lua_rawget(L, -2);
+            lua_Integer slot = lua_tointeger(L, -1);
+            lua_pop(L, 2);
+            if (slot > 0) {
+                lazy->owner->lazy_field2lua(L, *lazy, static_cast<size_t>(slot - 1), pins);
+                lua_pushvalue(L, key);
+                lua_pushvalue(L, -2);
+                lua_rawset(L, cache);
             }
             else
-                PRINTF("cant find message descriptor %s source compiled poll \n", structName);
+                lua_pushnil(L);
+        }
+        lua_replace(L, pins);
+        lua_settop(L, pins);
+    }
+
+    // the field slot + 1 a key names, 0 for any other key
+    lua_Integer ScriptProtobuf::lazy_slot(lua_State* L, const LazyMessage* lazy, int key) {
+        if (lua_type(L, key) != LUA_TSTRING)
+            return 0;
+        key = lua_absindex(L, key);
+        lua_rawgeti(L, LUA_REGISTRYINDEX, lazy->plan->names);
+        lua_pushvalue(L, key);
+        lua_rawget(L, -2);
+        lua_Integer slot = lua_tointeger(L, -1);
+        lua_pop(L, 2);
+        return slot;
+    }
+
+    int ScriptProtobuf::LazyIndex(lua_State* L) {
+        luaL_checkudata(L, 1, kLazyMetatable);
+        lazy_get(L, 1, 2);
+        return 1;
+    }
+
+    // assignments land in the cache, the encoded bytes are never touched; a field assigned nil
+    // keeps a tombstone so it is not decoded again
+    int ScriptProtobuf::LazyNewIndex(lua_State* L) {
+        LazyMessage* lazy = static_cast<LazyMessage*>(luaL_checkudata(L, 1, kLazyMetatable));
+        lua_settop(L, 3);
+        if (lua_isnil(L, 3) && lazy_slot(L, lazy, 2) > 0)
+            lua_pushlightuserdata(L, const_cast<char*>(&kLazyTombstone));
+        else
+            lua_pushvalue(L, 3);
+        lua_getuservalue(L, 1);
+        lua_rawgeti(L, -1, 3);
+        lua_pushvalue(L, 2);
+        lua_pushvalue(L, 4);
+        lua_rawset(L, -3);
+        return 0;
+    }
+
+    int ScriptProtobuf::LazyPairs(lua_State* L) {
+        luaL_checkudata(L, 1, kLazyMetatable);
+        lua_pushcfunction(L, (Guard<LazyOwner, LazyNext>));
+        lua_pushvalue(L, 1);
+        lua_pushnil(L);
+        return 3;
+    }
+
+    // fields in plan order, each one decoded as it is reached, then the other keys assigned to the proxy
+    int ScriptProtobuf::LazyNext(lua_State* L) {
+        LazyMessage* lazy = static_cast<LazyMessage*>(luaL_checkudata(L, 1, kLazyMetatable));
+        lua_settop(L, 2);
+        lua_Integer slot = lua_isnil(L, 2) ? 0 : lazy_slot(L, lazy, 2);
+        if (lua_isnil(L, 2) || slot > 0) {
+            // oneof members that are not set and fields assigned nil have no value, they are passed over
+            for (; static_cast<size_t>(slot) < lazy->plan->fields.size(); ++slot) {
+                lua_settop(L, 2);
+                lua_rawgeti(L, LUA_REGISTRYINDEX, lazy->plan->fields[slot].key);
+                lazy_get(L, 1, 3);
+                if (!lua_isnil(L, -1))
+                    return 2;
+            }
+            lua_settop(L, 1);
+            lua_pushnil(L);
+        }
+
+        lua_getuservalue(L, 1);
+        lua_rawgeti(L, -1, 3);
+        lua_pushvalue(L, 2);
+        while (lua_next(L, -2)) {
+            if (lazy_slot(L, lazy, -2) == 0)
+                return 2;
+            lua_pop(L, 1);
+        }
+        return 0;
+    }
+
+    // the border of the keys assigned to the proxy, as # of a plain decoded table
+    int ScriptProtobuf::LazyLen(lua_State* L) {
+        luaL_checkudata(L, 1, kLazyMetatable);
+        lua_getuservalue(L, 1);
+        lua_rawgeti(L, -1, 3);
+        lua_pushinteger(L, static_cast<lua_Integer>(lua_rawlen(L, -1)));
+        return 1;
+    }
+
+    // reflection fallback: ParseFromArray -> DynamicMessage -> lua table
+    int ScriptProtobuf::DecodeReflect(lua_State* L) {
+        ScriptProtobuf* self = lua_checkself<ScriptProtobuf>(L);
+        const char*     structName = luaL_checkstring(L, 2);
 
-            delete pbMsg;
+        const Descriptor* descriptor = self->find_message_descriptor(structName);
+        const Message*    prototype = descriptor ? self->find_prototype(descriptor) : nullptr;
+        if (!prototype) {
+            PRINTF("decode_pb(): failed to create pb message. name = %s\n", structName);
+            lua_newtable(L);
+            return 1;
+        }
+        sol::optional<lua_Integer> i, j;
+        lua_rangeargs(L, 4, &i, &j);
+        const char* data = nullptr;
+        size_t      size = 0;
+        lua_checkbytes(L, 3, i, j, &data, &size);
+        self->decode_reflect(L, prototype, data, size);
+        return 1;
+    }
+
+    // pushes the decoded table, on the stack of the calling thread
+    void ScriptProtobuf::decode_reflect(lua_State* L, const Message* prototype, const char* data, size_t size) {
+        int top = lua_gettop(L);
+        lua_createtable(L, 0, prototype->GetDescriptor()->field_count());
+
+        ArenaScope scope(this);
+        Message*   pbMsg = prototype->New(scope.arena);
+        if (pbMsg->ParseFromArray(data, static_cast<int>(size)))
+            protobuf2lua(L, top + 1, *pbMsg);
+        else
+            PRINTF("decode_pb(): parse failed. name = %s\n", prototype->GetTypeName().c_str());
+        release_message(pbMsg, scope.arena);
+        lua_settop(L, top + 1);
+    }
+
+    int ScriptProtobuf::GetEnum(lua_State* L) {
+        ScriptProtobuf* self = lua_checkself<ScriptProtobuf>(L);
+        const char*     structName = luaL_checkstring(L, 2);
+        bool            frozen = false;
+        if (lua_type(L, 3) == LUA_TTABLE) {
+            lua_getfield(L, 3, "frozen");
+            frozen = lua_toboolean(L, -1) != 0;
+            lua_pop(L, 1);
+        }
+        self->get_enum(L, structName, frozen);
+        return 1;
+    }
+
+    int ScriptProtobuf::GetStruct(lua_State* L) {
+        ScriptProtobuf* self = lua_checkself<ScriptProtobuf>(L);
+        const char*  structName = luaL_checkstring(L, 2);
+        bool         shared = false;
+        if (lua_type(L, 3) == LUA_TTABLE) {
+            lua_getfield(L, 3, "defaults");
+            const char* mode = lua_tostring(L, -1);
+            if (mode && strcmp(mode, "metatable") == 0)
+                shared = true;
+            else if (mode && strcmp(mode, "fill") != 0)
+                PRINTF("get_message(): unknown defaults mode %s\n", mode);
+            lua_pop(L, 1);
+        }
+        self->get_struct(L, structName, shared);
+        return 1;
+    }
+
+    // __newindex of a frozen get_enum table, every caller shares it
+    static int enum_newindex(lua_State* L) {
+        PRINTF("enum table is read-only, %s not set\n", luaL_tolstring(L, 2, nullptr));
+        return 0;
+    }
+
+    static int enum_next(lua_State* L) {
+        lua_settop(L, 2);
+        if (lua_next(L, 1))
+            return 2;
+        lua_pushnil(L);
+        return 1;
+    }
+
+    // __pairs of a frozen get_enum table walks the values behind it, upvalue 1
+    static int enum_pairs(lua_State* L) {
+        lua_pushcfunction(L, enum_next);
+        lua_pushvalue(L, lua_upvalueindex(1));
+        lua_pushnil(L);
+        return 3;
+    }
+
+    // name -> number, a fresh table per call copied from the cached values, the caller may change it.
+    // With {frozen = true} one read-only table per enum, built on first use and shared by every caller:
+    // no copy per call, but next() and rawset see the empty table in front of the values
+    void ScriptProtobuf::get_enum(lua_State* L, const char* structName, bool frozen) {
+        auto descriptor = find_enum_descriptor(structName);
+        if (!descriptor) {
+            PRINTF("cant find message  %s source compiled poll \n", structName);
+            lua_newtable(L);
+            return;
+        }
+
+        EnumPlan* plan = enum_plan(L, descriptor);
+        if (frozen) {
+            if (plan->frozen != LUA_NOREF) {
+                lua_rawgeti(L, LUA_REGISTRYINDEX, plan->frozen);
+                return;
+            }
+            lua_newtable(L);
+            lua_createtable(L, 0, 4);
+            lua_rawgeti(L, LUA_REGISTRYINDEX, plan->values);
+            lua_setfield(L, -2, "__index");
+            lua_pushcfunction(L, enum_newindex);
+            lua_setfield(L, -2, "__newindex");
+            lua_rawgeti(L, LUA_REGISTRYINDEX, plan->values);
+            lua_pushcclosure(L, enum_pairs, 1);
+            lua_setfield(L, -2, "__pairs");
+            lua_pushboolean(L, 0);
+            lua_setfield(L, -2, "__metatable");
+            lua_setmetatable(L, -2);
+            lua_pushvalue(L, -1);
+            plan->frozen = luaL_ref(L, LUA_REGISTRYINDEX);
+            return;
+        }
+
+        lua_createtable(L, 0, descriptor->value_count());
+        lua_rawgeti(L, LUA_REGISTRYINDEX, plan->values);
+        lua_pushnil(L);
+        while (lua_next(L, -2)) {
+            lua_pushvalue(L, -2);
+            lua_insert(L, -2);
+            lua_rawset(L, -5);
+        }
+        lua_pop(L, 1);
+    }
+
+    // a blank message with every field set to its default, so it iterates and encodes as a whole record;
+    // with {defaults = "metatable"} an empty table reading them through the shared defaults metatable of the type,
+    // as decode builds them
+    void ScriptProtobuf::get_struct(lua_State* L, const char* structName, bool shared) {
+        const Descriptor* descriptor = find_message_descriptor(structName);
+        if (!descriptor) {
+            PRINTF("cant find message  %s source compiled poll \n", structName);
+            lua_newtable(L);
+            return;
+        }
+        DecodeOptions saved = m_decode;
+        m_decode = DecodeOptions();
+        if (shared) {
+            lua_newtable(L);
+            defaults_metatable2lua(L, *message_plan(L, descriptor));
+            lua_setmetatable(L, -2);
         }
         else
+            default_message2lua(L, *message_plan(L, descriptor));
+        m_decode = saved;
+    }
+
+    int ScriptProtobuf::Encode(lua_State* L) {
+        ScriptProtobuf* self = lua_checkself<ScriptProtobuf>(L);
+        const char*     structName = luaL_checkstring(L, 2);
+        luaL_checktype(L, 3, LUA_TTABLE);
+
+        const Descriptor* descriptor = self->find_message_descriptor(structName);
+        if (!descriptor) {
+            PRINTF("cant find message  %s source compiled poll \n", structName);
+            lua_pushliteral(L, "");
+            return 1;
+        }
+        self->push_plan(L, 3, *self->message_plan(L, descriptor));
+        return 1;
+    }
+
+    // appends to the caller's buffer, returns the bytes written, 0 on failure
+    size_t ScriptProtobuf::EncodeTo(ScriptProtobufBuffer& buffer, const char* structName, const sol::table& tab) {
+        const Descriptor* descriptor = find_message_descriptor(structName);
+        if (!descriptor) {
+            PRINTF("cant find message  %s source compiled poll \n", structName);
+            return 0;
+        }
+        lua_State* L = tab.lua_state();
+        size_t     start = buffer.storage().size();
+        tab.push();
+        encode_plan(L, lua_gettop(L), *message_plan(L, descriptor), buffer.storage());
+        lua_pop(L, 1);
+        return buffer.storage().size() - start;
+    }
+
+    // array of tables -> one string of length delimited messages, or with split an array of strings
+    int ScriptProtobuf::EncodeMany(lua_State* L) {
+        ScriptProtobuf* self = lua_checkself<ScriptProtobuf>(L);
+        const char*     structName = luaL_checkstring(L, 2);
+
+        const Descriptor* descriptor = self->find_message_descriptor(structName);
+        if (!descriptor) {
             PRINTF("cant find message  %s source compiled poll \n", structName);
+            lua_pushliteral(L, "");
+            return 1;
+        }
+        return self->encode_many(L, *self->message_plan(L, descriptor), 3, lua_toboolean(L, 4) != 0);
+    }
+
+    // length delimited messages, or an array of strings -> array of tables
+    int ScriptProtobuf::DecodeMany(lua_State* L) {
+        ScriptProtobuf* self = lua_checkself<ScriptProtobuf>(L);
+        const char*     structName = luaL_checkstring(L, 2);
+
+        const Descriptor* descriptor = self->find_message_descriptor(structName);
+        if (!descriptor) {
+            PRINTF("decode_pb(): failed to create pb message. name = %s\n", structName);
+            lua_newtable(L);
+            return 1;
+        }
+        sol::optional<lua_Integer> i, j;
+        lua_rangeargs(L, 4, &i, &j);
+        return self->decode_many(L, *self->message_plan(L, descriptor), 3, i, j);
+    }
+
+    // a message that fails to encode fails the batch, nil and its index are returned
+    int ScriptProtobuf::encode_many(lua_State* L, const MessagePlan& plan, int index, bool split) {
+        if (lua_type(L, index) != LUA_TTABLE) {
+            PRINTF("encode_many(): messages must be an array. name = %s\n", plan.descriptor->full_name().c_str());
+            if (split)
+                lua_newtable(L);
+            else
+                lua_pushliteral(L, "");
+            return 1;
+        }
+
+        lua_Integer count = static_cast<lua_Integer>(lua_rawlen(L, index));
+        int         result = 0;
+        if (split) {
+            lua_createtable(L, static_cast<int>(count), 0);
+            result = lua_gettop(L);
+        }
+
+        // the scratch buffer is shared by the whole batch
+        std::string  local;
+        bool         scratch = !m_encoding;
+        std::string& out = scratch ? m_encode_buffer : local;
+        m_encoding = true;
+        out.clear();
+
+        lua_Integer failed = 0;
+        for (lua_Integer i = 1; i <= count; ++i) {
+            size_t start = out.size();
+            if (!split)
+                out.push_back(0);
+
+            lua_rawgeti(L, index, i);
+            bool ok = lua_type(L, -1) == LUA_TTABLE && lua2wire(L, lua_gettop(L), plan, out);
+            lua_pop(L, 1);
+            if (!ok) {
+                PRINTF("encode_many(): failed to convert to pb message. name = %s index = %lld\n",
+                    plan.descriptor->full_name().c_str(), static_cast<long long>(i));
+                failed = i;
+                break;
+            }
+
+            if (split) {
+                lua_pushlstring(L, out.data(), out.size());
+                lua_rawseti(L, result, i);
+                out.clear();
+            }
+            else {
+                wire_patch_length(out, start);
+            }
+        }
+        if (failed) {
+            if (split)
+                lua_pop(L, 1);
+            lua_pushnil(L);
+            lua_pushinteger(L, failed);
+        }
+        else if (!split)
+            lua_pushlstring(L, out.data(), out.size());
+
+        if (scratch) {
+            m_encoding = false;
+            if (m_encode_buffer.capacity() > 1024 * 1024)
+                std::string().swap(m_encode_buffer);
+        }
+        return failed ? 2 : 1;
+    }
+
+    // a message that fails to parse fails the batch, nil and its index are returned, as encode_many does
+    int ScriptProtobuf::decode_many(lua_State* L, const MessagePlan& plan, int index, const sol::optional<lua_Integer>& i, const sol::optional<lua_Integer>& j) {
+        int fields = static_cast<int>(plan.fields.size());
+
+        if (lua_type(L, index) == LUA_TTABLE) {
+            lua_Integer count = static_cast<lua_Integer>(lua_rawlen(L, index));
+            lua_createtable(L, static_cast<int>(count), 0);
+            int result = lua_gettop(L);
+            for (lua_Integer n = 1; n <= count; ++n) {
+                lua_rawgeti(L, index, n);
+                const char* data = nullptr;
+                size_t      size = 0;
+                bool        ok = lua_tobytes(L, -1, sol::nullopt, sol::nullopt, &data, &size);
+                lua_pop(L, 1);
+
+                io::CodedInputStream input(reinterpret_cast<const uint8*>(data), static_cast<int>(size));
+                lua_createtable(L, 0, fields);
+                if (!ok || !wire2lua(L, result + 1, plan, input, DECODE_NEW) || !input.ConsumedEntireMessage()) {
+                    PRINTF("decode_many(): parse failed. name = %s index = %lld\n", plan.descriptor->full_name().c_str(), static_cast<long long>(n));
+                    lua_settop(L, result - 1);
+                    lua_pushnil(L);
+                    lua_pushinteger(L, n);
+                    return 2;
+                }
+                lua_rawseti(L, result, n);
+            }
+            return 1;
+        }
 
-        return root;
+        const char* data = nullptr;
+        size_t      size = 0;
+        if (!lua_tobytes(L, index, i, j, &data, &size))
+            return luaL_argerror(L, index, lua_pushfstring(L, "string or array expected, got %s", luaL_typename(L, index)));
+
+        lua_newtable(L);
+        int                  result = lua_gettop(L);
+        io::CodedInputStream input(reinterpret_cast<const uint8*>(data), static_cast<int>(size));
+        for (lua_Integer n = 1; !input.ExpectAtEnd(); ++n) {
+            lua_createtable(L, 0, fields);
+            if (!message_wire2lua(L, result + 1, plan, input, DECODE_NEW)) {
+                PRINTF("decode_many(): parse failed. name = %s index = %lld\n", plan.descriptor->full_name().c_str(), static_cast<long long>(n));
+                lua_settop(L, result - 1);
+                lua_pushnil(L);
+                lua_pushinteger(L, n);
+                return 2;
+            }
+            lua_rawseti(L, result, n);
+        }
+        return 1;
+    }
+
+    // appends to out, which is left as it was on failure
+    bool ScriptProtobuf::encode_plan(lua_State* L, int index, const MessagePlan& plan, std::string& out) {
+        size_t start = out.size();
+        bool   ok = lua2wire(L, index, plan, out);
+
+        if (!ok) {
+            PRINTF("Encode(): failed to convert to pb message. name = %s\n", plan.descriptor->full_name().c_str());
+            out.resize(start);
+        }
+        return ok;
     }
 
-    std::string ScriptProtobuf::Encode(const char* structName, const sol::table& tab) {
-        Message* message = lua2protobuf(structName, tab);
-        if (message) {
+    // encodes into the scratch buffer and pushes one lua string, no std::string per call
+    void ScriptProtobuf::push_plan(lua_State* L, int index, const MessagePlan& plan) {
+        if (m_encoding) {
             std::string b;
-            message->SerializeToString(&b);
-            delete message;
+            encode_plan(L, index, plan, b);
+            lua_pushlstring(L, b.data(), b.size());
+            return;
+        }
+
+        m_encoding = true;
+        m_encode_buffer.clear();
+        encode_plan(L, index, plan, m_encode_buffer);
+        lua_pushlstring(L, m_encode_buffer.data(), m_encode_buffer.size());
+        m_encoding = false;
 
-            return b;
+        // one oversized message should not pin its buffer for the lifetime of the pb object
+        if (m_encode_buffer.capacity() > 1024 * 1024)
+            std::string().swap(m_encode_buffer);
+    }
+
+    // reflection fallback: lua table -> DynamicMessage -> SerializeToString
+    int ScriptProtobuf::EncodeReflect(lua_State* L) {
+        ScriptProtobuf* self = lua_checkself<ScriptProtobuf>(L);
+        const char*     structName = luaL_checkstring(L, 2);
+        luaL_checktype(L, 3, LUA_TTABLE);
+
+        const Descriptor* descriptor = self->find_message_descriptor(structName);
+        const Message*    prototype = descriptor ? self->find_prototype(descriptor) : nullptr;
+        if (!prototype) {
+            PRINTF("cant find message  %s source compiled poll \n", structName);
+            lua_pushliteral(L, "");
+            return 1;
         }
-        else {
-            PRINTF("Encode(): failed to convert to pb message. name = %s\n", structName);
+        self->encode_reflect(L, prototype, 3);
+        return 1;
+    }
+
+    // pushes the encoded string, an empty one on failure
+    void ScriptProtobuf::encode_reflect(lua_State* L, const Message* prototype, int index) {
+        // a record reading its defaults through the defaults metatable holds no keys of its own
+        if (lua_table_empty(L, index) && !has_defaults_metatable(L, index, *message_plan(L, prototype->GetDescriptor()))) {
+            PRINTF("the %s is empty.\n", prototype->GetTypeName().c_str());
+            lua_pushliteral(L, "");
+            return;
         }
 
-        return std::string("");
+        std::string b;
+        ArenaScope  scope(this);
+        Message*    message = prototype->New(scope.arena);
+        if (lua2protobuf(L, index, message))
+            message->SerializeToString(&b);
+        else
+            PRINTF("Encode(): failed to convert to pb message. name = %s\n", prototype->GetTypeName().c_str());
+        release_message(message, scope.arena);
+        lua_pushlstring(L, b.data(), b.size());
     }
 
-    bool ScriptProtobuf::single_field_lua2pb(Message* message, const Reflection* reflection, const FieldDescriptor* fd, const sol::object& source) {
-        if (!source.valid()) {
+    // the value at index, nil when the field is absent
+    bool ScriptProtobuf::single_field_lua2pb(lua_State* L, int index, Message* message, const Reflection* reflection, const FieldDescriptor* fd) {
+        if (lua_isnil(L, index)) {
             if (fd->is_required()) {
                 PRINTF("lose required field %s", fd->name().c_str());
                 return false;
@@ -360,68 +2089,58 @@ namespace lua_module {
 
         switch (fd->cpp_type()) {
         case FieldDescriptor::CPPTYPE_DOUBLE: {
-            reflection->SetDouble(message, fd, source.as<double>());
+            reflection->SetDouble(message, fd, lua_tonumber(L, index));
             break;
         }
         case FieldDescriptor::CPPTYPE_FLOAT: {
-            reflection->SetFloat(message, fd, source.as<float>());
+            reflection->SetFloat(message, fd, static_cast<float>(lua_tonumber(L, index)));
             break;
         }
         case FieldDescriptor::CPPTYPE_INT64: {
-            reflection->SetInt64(message, fd, source.as<int64>());
+            reflection->SetInt64(message, fd, lua_toint64(L, index));
             break;
         }
         case FieldDescriptor::CPPTYPE_UINT64: {
-            reflection->SetUInt64(message, fd, source.as<uint64>());
+            reflection->SetUInt64(message, fd, static_cast<uint64>(lua_toint64(L, index)));
             break;
         }
         case FieldDescriptor::CPPTYPE_ENUM: {
-            const EnumDescriptor* enumDescriptor = fd->enum_type();
-            if (source.is<string>()) {
-                std::string                s = source.as<string>();
-                const EnumValueDescriptor* valueDescriptor = enumDescriptor->FindValueByName(s);
-                if (!valueDescriptor) {
-                    PRINTF("cant find enum name %s:%s \n", enumDescriptor->name().c_str(), s.c_str());
-                    return false;
-                }
-                reflection->SetEnum(message, fd, valueDescriptor);
-            }
-            else {
-                int32_t                    n = source.as<int32>();
-                const EnumValueDescriptor* valueDescriptor = enumDescriptor->FindValueByNumber(n);
-                if (!valueDescriptor) {
-                    PRINTF("cant find enum number %s:%d \n", enumDescriptor->name().c_str(), n);
-                    return false;
-                }
-                reflection->SetEnum(message, fd, valueDescriptor);
-            }
+            const EnumValueDescriptor* valueDescriptor = enum_lua2pb(L, index, fd->enum_type());
+            if (!valueDescriptor)
+                return false;
+            reflection->SetEnum(message, fd, valueDescriptor);
             break;
         }
         case FieldDescriptor::CPPTYPE_INT32: {
-            reflection->SetInt32(message, fd, source.as<int32>());
+            reflection->SetInt32(message, fd, static_cast<int32>(lua_toint64(L, index)));
             break;
         }
         case FieldDescriptor::CPPTYPE_UINT32: {
-            reflection->SetUInt32(message, fd, source.as<uint32>());
+            reflection->SetUInt32(message, fd, static_cast<uint32>(lua_toint64(L, index)));
             break;
         }
         case FieldDescriptor::CPPTYPE_STRING: {
-            reflection->SetString(message, fd, source.as<string>());
+            size_t      len = 0;
+            const char* s = lua_tobuffer(L, index, &len);
+            if (!s) {
+                PRINTF("field %s expect string got %s \n", fd->name().c_str(), luaL_typename(L, index));
+                return false;
+            }
+            // copied twice, into the scratch and by SetString: Reflection has no move or aliasing setter.
+            // The scratch keeps its capacity, so no string is allocated per field
+            m_string_scratch.assign(s, len);
+            reflection->SetString(message, fd, m_string_scratch);
+            if (m_string_scratch.capacity() > 1024 * 1024)
+                std::string().swap(m_string_scratch);
             break;
         }
         case FieldDescriptor::CPPTYPE_BOOL: {
-            reflection->SetBool(message, fd, source.as<bool>());
+            reflection->SetBool(message, fd, lua_toboolean(L, index) != 0);
             break;
         }
         case FieldDescriptor::CPPTYPE_MESSAGE: {
-            sol::table tt = source.as<sol::table>();
-            Message*   v = lua2protobuf(fd->message_type()->full_name(), tt);
-            if (!v) {
-                PRINTF("convert to message %s failed whith value %s \n", fd->message_type()->full_name().c_str(), fd->name().c_str());
+            if (!sub_message_lua2pb(L, index, fd, reflection->MutableMessage(message, fd)))
                 return false;
-            }
-            reflection->MutableMessage(message, fd)->CopyFrom(*v);
-            delete v;
             break;
         }
         default: {
@@ -431,135 +2150,182 @@ namespace lua_module {
         }  // switch
         return true;
     }
-    // lua table -> array
-    bool ScriptProtobuf::repeated_field_lua2pb(Message* message, const Reflection* reflection, const FieldDescriptor* fd, const sol::object& source) {
-        if (!source.valid()) {
-            //				PRINTF("%s value invalid.\n", fd->name().c_str());
-            return true;
+    // lua table -> array, the table at index
+    bool ScriptProtobuf::repeated_field_lua2pb(lua_State* L, int index, Message* message, const Reflection* reflection, const FieldDescriptor* fd) {
+        size_t count = lua_rawlen(L, index);
+        // string elements are assigned in place, the field is looked up once
+        RepeatedPtrField<std::string>* strings = nullptr;
+        if (fd->cpp_type() == FieldDescriptor::CPPTYPE_STRING) {
+            strings = reflection->MutableRepeatedPtrField<std::string>(message, fd);
+            strings->Reserve(strings->size() + static_cast<int>(count));
         }
-        auto curr = source.as<sol::table>();
-        for (size_t i = 1; i <= curr.size(); i++) {
-            auto value = curr[i];
+        for (size_t i = 1; i <= count; i++) {
+            lua_rawgeti(L, index, static_cast<lua_Integer>(i));
+            int value = lua_gettop(L);
             switch (fd->cpp_type()) {
             case FieldDescriptor::CPPTYPE_DOUBLE: {
-                reflection->AddDouble(message, fd, value.get<double>());
+                reflection->AddDouble(message, fd, lua_tonumber(L, value));
                 break;
             }
             case FieldDescriptor::CPPTYPE_FLOAT: {
-                reflection->AddFloat(message, fd, value.get<float>());
+                reflection->AddFloat(message, fd, static_cast<float>(lua_tonumber(L, value)));
                 break;
             }
             case FieldDescriptor::CPPTYPE_INT64: {
-                int64 n = value.get<int64>();
-                reflection->AddInt64(message, fd, n);
+                reflection->AddInt64(message, fd, lua_toint64(L, value));
                 break;
             }
             case FieldDescriptor::CPPTYPE_UINT64: {
-                uint64 n = value.get<uint64>();
-                reflection->AddUInt64(message, fd, n);
+                reflection->AddUInt64(message, fd, static_cast<uint64>(lua_toint64(L, value)));
                 break;
             }
             case FieldDescriptor::CPPTYPE_ENUM:  // support enum name or number
             {
-                const EnumDescriptor* enumDescriptor = fd->enum_type();
-                if (value.get_type() == sol::type::string) {
-                    std::string                s = value.get<string>();
-                    const EnumValueDescriptor* valueDescriptor = enumDescriptor->FindValueByName(s);
-                    if (!valueDescriptor) {
-                        PRINTF("cant find enum name %s:%s \n", enumDescriptor->name().c_str(), s.c_str());
-                        return false;
-                    }
-                    reflection->AddEnum(message, fd, valueDescriptor);
-                }
-                else {
-                    int32_t                    n = value.get<int32>();
-                    const EnumValueDescriptor* valueDescriptor = enumDescriptor->FindValueByNumber(n);
-                    if (!valueDescriptor) {
-                        PRINTF("cant find enum number %s:%d \n", enumDescriptor->name().c_str(), n);
-                        return false;
-                    }
-                    reflection->AddEnum(message, fd, valueDescriptor);
+                const EnumValueDescriptor* valueDescriptor = enum_lua2pb(L, value, fd->enum_type());
+                if (!valueDescriptor) {
+                    lua_pop(L, 1);
+                    return false;
                 }
+                reflection->AddEnum(message, fd, valueDescriptor);
                 break;
             }
             case FieldDescriptor::CPPTYPE_INT32: {
-                reflection->AddInt32(message, fd, value.get<int32>());
+                reflection->AddInt32(message, fd, static_cast<int32>(lua_toint64(L, value)));
                 break;
             }
             case FieldDescriptor::CPPTYPE_UINT32: {
-                reflection->AddUInt32(message, fd, value.get<uint32>());
+                reflection->AddUInt32(message, fd, static_cast<uint32>(lua_toint64(L, value)));
                 break;
             }
             case FieldDescriptor::CPPTYPE_STRING: {
-                reflection->AddString(message, fd, value.get<string>());
+                size_t      len = 0;
+                const char* s = lua_tobuffer(L, value, &len);
+                if (!s) {
+                    PRINTF("field %s expect string got %s \n", fd->name().c_str(), luaL_typename(L, value));
+                    lua_pop(L, 1);
+                    return false;
+                }
+                strings->Add()->assign(s, len);
                 break;
             }
             case FieldDescriptor::CPPTYPE_BOOL: {
-                reflection->AddBool(message, fd, value.get<bool>());
+                reflection->AddBool(message, fd, lua_toboolean(L, value) != 0);
                 break;
             }
             case FieldDescriptor::CPPTYPE_MESSAGE: {
-                Message* v = lua2protobuf(fd->message_type()->full_name(), value.get<sol::table>());
-                if (!v) {
-                    PRINTF("convert to message %s failed whith value %s \n", fd->message_type()->full_name().c_str(), fd->name().c_str());
+                if (!sub_message_lua2pb(L, value, fd, reflection->AddMessage(message, fd))) {
+                    lua_pop(L, 1);
                     return false;
                 }
-                reflection->AddMessage(message, fd)->CopyFrom(*v);
-                delete v;
                 break;
             }
             default: {
                 PRINTF("UNKNOWN CPP TYPE %d", fd->cpp_type());
+                lua_pop(L, 1);
                 return false;
             }
             }  // switch
+            lua_pop(L, 1);
         }    // for each lua table
         return true;
     }
 
-    Message* ScriptProtobuf::lua2protobuf(const std::string& pbName, const sol::table& tab) {
-        if (tab.empty()) {
-            PRINTF("the %s is empty.\n", pbName.c_str());
-            return nullptr;
-        }
+    // lua table -> map entries, the table at index; a bad entry fails the encode, as on the wire path
+    bool ScriptProtobuf::map_field_lua2pb(lua_State* L, int index, Message* message, const Reflection* reflection, const FieldDescriptor* fd) {
+        lua_pushnil(L);
+        while (lua_next(L, index)) {
+            auto new_record = reflection->AddMessage(message, fd);
+            auto ref = new_record->GetReflection();
+            auto desc = new_record->GetDescriptor();
+            int  top = lua_gettop(L);
+            // converted from a copy, lua_tolstring on the key itself would break lua_next
+            lua_pushvalue(L, top - 1);
+            if (!single_field_lua2pb(L, top + 1, new_record, ref, desc->field(0)) ||
+                !single_field_lua2pb(L, top, new_record, ref, desc->field(1)))
+            {
+                PRINTF("(lua map error) key=%s \n", lua_tostring(L, top + 1) ? lua_tostring(L, top + 1) : luaL_typename(L, top + 1));
+                lua_settop(L, top - 2);
+                return false;
+            }
+            lua_settop(L, top - 1);
+        }
+        return true;
+    }
 
-        Message* message = create_message(pbName);
-        if (!message) {
-            PRINTF("cant find message  %s source compiled poll \n", pbName.c_str());
-            return nullptr;
+    // a lua string names the value, looked up in the cached values, anything else is its number
+    const EnumValueDescriptor* ScriptProtobuf::enum_lua2pb(lua_State* L, int index, const EnumDescriptor* enumDescriptor) {
+        const EnumValueDescriptor* valueDescriptor = nullptr;
+        if (lua_type(L, index) == LUA_TSTRING) {
+            lua_rawgeti(L, LUA_REGISTRYINDEX, enum_plan(L, enumDescriptor)->values);
+            lua_pushvalue(L, index);
+            if (lua_rawget(L, -2) == LUA_TNUMBER)
+                valueDescriptor = enumDescriptor->FindValueByNumber(static_cast<int>(lua_tointeger(L, -1)));
+            lua_pop(L, 2);
+            if (!valueDescriptor)
+                PRINTF("cant find enum name %s:%s \n", enumDescriptor->name().c_str(), lua_tostring(L, index));
+        }
+        else {
+            int32_t n = static_cast<int32_t>(lua_toint64(L, index));
+            valueDescriptor = enumDescriptor->FindValueByNumber(n);
+            if (!valueDescriptor)
+                PRINTF("cant find enum number %s:%d \n", enumDescriptor->name().c_str(), n);
         }
-        const Reflection* reflection = message->GetReflection();
-        const Descriptor* descriptor = message->GetDescriptor();
-        for (int i = 0; i < descriptor->field_count(); ++i) {
-            const FieldDescriptor* fd = descriptor->field(i);
-            const string&          name = fd->name();
-            sol::object            value = tab[name];
+        return valueDescriptor;
+    }
 
-            if (fd->is_repeated()) {
-                if (value.get_type() == sol::type::table) {
-                    if (fd->is_map()) {
-                        auto curr = value.as<sol::table>();
-                        curr.for_each(
-                            [&](sol::object key, sol::object value) {
-                            auto new_record = reflection->AddMessage(message, fd);
-                            auto ref = new_record->GetReflection();
-                            auto desc = new_record->GetDescriptor();
-                            auto fd_key = desc->field(0);
-                            auto fd_value = desc->field(1);
-                            if (!single_field_lua2pb(new_record, ref, fd_key, key) ||
-                                !single_field_lua2pb(new_record, ref, fd_value, value))
-                            {
-                                PRINTF("(lua map error) key=%s \n", key.as<std::string>().c_str());
-                            } });
+    // fills a sub-message the parent already holds, MutableMessage or AddMessage, no temporary is copied in
+    // an empty table is an empty sub-message, as lua2wire writes it
+    bool ScriptProtobuf::sub_message_lua2pb(lua_State* L, int index, const FieldDescriptor* fd, Message* sub) {
+        if (lua_type(L, index) != LUA_TTABLE) {
+            PRINTF("convert to message %s failed whith value %s \n", fd->message_type()->full_name().c_str(), fd->name().c_str());
+            return false;
+        }
+        if (!lua2protobuf(L, index, sub)) {
+            PRINTF("convert to message %s failed whith value %s \n", fd->message_type()->full_name().c_str(), fd->name().c_str());
+            return false;
+        }
+        return true;
+    }
 
-                    }
-                    else {  // else is array
+    // the table at index, every field value is pushed above it while converted
+    bool ScriptProtobuf::lua2protobuf(lua_State* L, int index, Message* message) {
+        const Reflection*  reflection = message->GetReflection();
+        const MessagePlan* plan = message_plan(L, message->GetDescriptor());
+        if (!lua_checkstack(L, LUA_MINSTACK)) {
+            PRINTF("lua stack overflow encoding %s \n", message->GetTypeName().c_str());
+            return false;
+        }
 
-                        if (!repeated_field_lua2pb(message, reflection, fd, value)) {
-                            delete message;
-                            return nullptr;
-                        }
-                    }
+        // fields the defaults metatable answers for are unset
+        bool                   raw = has_defaults_metatable(L, index, *plan);
+        size_t                 oneofs = plan->oneofs.size();
+        int                    inline_cases[8];
+        std::unique_ptr<int[]> heap_cases(oneofs > 8 ? new int[oneofs] : nullptr);
+        int*                   cases = heap_cases ? heap_cases.get() : inline_cases;
+        if (!oneof_cases_lua(L, index, *plan, raw, cases))
+            return false;
+
+        for (const FieldPlan& field : plan->fields) {
+            const FieldDescriptor* fd = field.fd;
+            if (field.oneof >= 0 && cases[field.oneof] != &field - plan->fields.data())
+                continue;
+
+            // interned key from the plan, no lua string is built from fd->name()
+            // a required field is read through the defaults metatable, it is encoded with its default
+            lua_rawgeti(L, LUA_REGISTRYINDEX, field.key);
+            if (raw && !field.required)
+                lua_rawget(L, index);
+            else
+                lua_gettable(L, index);
+            int  value = lua_gettop(L);
+            bool ok = true;
+
+            if (fd->is_repeated()) {
+                if (lua_type(L, value) == LUA_TTABLE) {
+                    if (fd->is_map())
+                        ok = map_field_lua2pb(L, value, message, reflection, fd);
+                    else  // else is array
+                        ok = repeated_field_lua2pb(L, value, message, reflection, fd);
                 }
                 else {  //
                        //						PRINTF("warning: field %s type is %d", name.c_str(), value.get_type());
@@ -567,16 +2333,593 @@ namespace lua_module {
             }
             else  // else is single field
             {
-                if (!single_field_lua2pb(message, reflection, fd, value)) {
-                    delete message;
-                    return nullptr;
+                ok = single_field_lua2pb(L, value, message, reflection, fd);
+            }
+            lua_settop(L, value - 1);
+            if (!ok)
+                return false;
+        }
+        return true;
+    }
+
+    const ScriptProtobuf::FieldPlan* ScriptProtobuf::MessagePlan::find(int number) const {
+        if (number >= 0 && number < static_cast<int>(numbers.size())) {
+            int slot = numbers[number];
+            return slot < 0 ? nullptr : &fields[slot];
+        }
+        auto it = sparse.find(number);
+        return it == sparse.end() ? nullptr : &fields[it->second];
+    }
+
+    const ScriptProtobuf::MessagePlan* ScriptProtobuf::message_plan(lua_State* L, const Descriptor* descriptor) {
+        auto it = m_plans.find(descriptor);
+        if (it != m_plans.end())
+            return it->second;
+
+        // registered before the fields, so self-referential types find it
+        MessagePlan* plan = new MessagePlan();
+        plan->descriptor = descriptor;
+        plan->required = 0;
+        plan->has_repeated = false;
+        plan->defaults[0] = LUA_NOREF;
+        plan->defaults[1] = LUA_NOREF;
+        m_plans[descriptor] = plan;
+
+        lua_createtable(L, 0, descriptor->field_count());
+        plan->names = luaL_ref(L, LUA_REGISTRYINDEX);
+
+        // SerializeToString writes fields in field number order
+        std::vector<const FieldDescriptor*> fds;
+        for (int i = 0; i < descriptor->field_count(); ++i)
+            fds.push_back(descriptor->field(i));
+        std::sort(fds.begin(), fds.end(), [](const FieldDescriptor* a, const FieldDescriptor* b) {
+            return a->number() < b->number();
+        });
+
+        plan->oneofs.resize(descriptor->oneof_decl_count());
+        for (int i = 0; i < descriptor->oneof_decl_count(); ++i) {
+            std::string key = descriptor->oneof_decl(i)->name() + "_case";
+            lua_pushlstring(L, key.data(), key.size());
+            plan->oneofs[i].key = luaL_ref(L, LUA_REGISTRYINDEX);
+        }
+
+        int dense = fds.empty() ? 0 : std::min(fds.back()->number(), 1023) + 1;
+        plan->numbers.assign(dense, -1);
+        plan->fields.resize(fds.size());
+        for (size_t i = 0; i < fds.size(); ++i) {
+            const FieldDescriptor* fd = fds[i];
+            FieldPlan&             field = plan->fields[i];
+
+            field.fd = fd;
+            field.kind = fd->is_map() ? FIELD_MAP : (fd->is_packed() ? FIELD_PACKED : (fd->is_repeated() ? FIELD_REPEATED : FIELD_SINGLE));
+            field.wire_type = WireFormat::WireTypeForFieldType(fd->type());
+            field.packable = fd->is_packable();
+            field.required = fd->is_required();
+            field.proto3 = fd->file()->syntax() == FileDescriptor::SYNTAX_PROTO3;
+            field.skip_zero = field.proto3 && field.kind == FIELD_SINGLE && !fd->containing_oneof() &&
+                              fd->cpp_type() != FieldDescriptor::CPPTYPE_MESSAGE;
+
+            WireFormatLite::WireType tag_type = field.kind == FIELD_SINGLE || field.kind == FIELD_REPEATED ? field.wire_type : WireFormatLite::WIRETYPE_LENGTH_DELIMITED;
+            field.tag_size = static_cast<int>(io::CodedOutputStream::WriteVarint32ToArray(WireFormatLite::MakeTag(fd->number(), tag_type), field.tag) - field.tag);
+
+            lua_pushlstring(L, fd->name().data(), fd->name().size());
+            field.key = luaL_ref(L, LUA_REGISTRYINDEX);
+
+            lua_rawgeti(L, LUA_REGISTRYINDEX, plan->names);
+            lua_rawgeti(L, LUA_REGISTRYINDEX, field.key);
+            lua_pushinteger(L, static_cast<lua_Integer>(i + 1));
+            lua_rawset(L, -3);
+            lua_pop(L, 1);
+
+            field.packed_encode = nullptr;
+            field.packed_decode = nullptr;
+            switch (fd->type()) {
+#define LUAPB_FIELD_CODEC(TYPE)                                         \
+    case FieldDescriptor::TYPE:                                         \
+        field.encode = &ScriptProtobuf::value_lua2wire<FieldDescriptor::TYPE>; \
+        field.decode = &ScriptProtobuf::value_wire2lua<FieldDescriptor::TYPE>; \
+        break;
+#define LUAPB_PACKED_CODEC(TYPE)                                               \
+    case FieldDescriptor::TYPE:                                                \
+        field.encode = &ScriptProtobuf::value_lua2wire<FieldDescriptor::TYPE>;        \
+        field.decode = &ScriptProtobuf::value_wire2lua<FieldDescriptor::TYPE>;        \
+        field.packed_encode = &ScriptProtobuf::packed_lua2wire<FieldDescriptor::TYPE>; \
+        field.packed_decode = &ScriptProtobuf::packed_wire2lua<FieldDescriptor::TYPE>; \
+        break;
+                LUAPB_PACKED_CODEC(TYPE_DOUBLE)
+                LUAPB_PACKED_CODEC(TYPE_FLOAT)
+                LUAPB_PACKED_CODEC(TYPE_INT64)
+                LUAPB_PACKED_CODEC(TYPE_UINT64)
+                LUAPB_PACKED_CODEC(TYPE_INT32)
+                LUAPB_PACKED_CODEC(TYPE_FIXED64)
+                LUAPB_PACKED_CODEC(TYPE_FIXED32)
+                LUAPB_PACKED_CODEC(TYPE_BOOL)
+                LUAPB_FIELD_CODEC(TYPE_STRING)
+                LUAPB_FIELD_CODEC(TYPE_GROUP)
+                LUAPB_FIELD_CODEC(TYPE_MESSAGE)
+                LUAPB_FIELD_CODEC(TYPE_BYTES)
+                LUAPB_PACKED_CODEC(TYPE_UINT32)
+                LUAPB_FIELD_CODEC(TYPE_ENUM)
+                LUAPB_PACKED_CODEC(TYPE_SFIXED32)
+                LUAPB_PACKED_CODEC(TYPE_SFIXED64)
+                LUAPB_PACKED_CODEC(TYPE_SINT32)
+                LUAPB_PACKED_CODEC(TYPE_SINT64)
+#undef LUAPB_PACKED_CODEC
+#undef LUAPB_FIELD_CODEC
+            default:
+                field.encode = &ScriptProtobuf::value_lua2wire<0>;
+                field.decode = &ScriptProtobuf::value_wire2lua<0>;
+                break;
+            }
+            field.message = fd->cpp_type() == FieldDescriptor::CPPTYPE_MESSAGE ? message_plan(L, fd->message_type()) : nullptr;
+            field.enumeration = fd->cpp_type() == FieldDescriptor::CPPTYPE_ENUM ? enum_plan(L, fd->enum_type()) : nullptr;
+            field.oneof = fd->containing_oneof() ? fd->containing_oneof()->index() : -1;
+            if (field.oneof >= 0)
+                plan->oneofs[field.oneof].slots.push_back(static_cast<int>(i));
+
+            if (field.kind != FIELD_SINGLE)
+                plan->has_repeated = true;
+            if (field.required)
+                plan->required++;
+            if (fd->number() < dense)
+                plan->numbers[fd->number()] = static_cast<int>(i);
+            else
+                plan->sparse[fd->number()] = static_cast<int>(i);
+        }
+        return plan;
+    }
+
+    void ScriptProtobuf::release_plans() {
+        lua_State* L = m_nil_object.lua_state();
+        for (auto& it : m_plans) {
+            for (const FieldPlan& field : it.second->fields)
+                luaL_unref(L, LUA_REGISTRYINDEX, field.key);
+            luaL_unref(L, LUA_REGISTRYINDEX, it.second->names);
+            luaL_unref(L, LUA_REGISTRYINDEX, it.second->defaults[0]);
+            luaL_unref(L, LUA_REGISTRYINDEX, it.second->defaults[1]);
+            for (const OneofPlan& oneof : it.second->oneofs)
+                luaL_unref(L, LUA_REGISTRYINDEX, oneof.key);
+            delete it.second;
+        }
+        m_plans.clear();
+
+        for (auto& it : m_enums) {
+            luaL_unref(L, LUA_REGISTRYINDEX, it.second->values);
+            luaL_unref(L, LUA_REGISTRYINDEX, it.second->names);
+            luaL_unref(L, LUA_REGISTRYINDEX, it.second->frozen);
+            delete it.second;
+        }
+        m_enums.clear();
+    }
+
+    ScriptProtobuf::EnumPlan* ScriptProtobuf::enum_plan(lua_State* L, const EnumDescriptor* descriptor) {
+        auto it = m_enums.find(descriptor);
+        if (it != m_enums.end())
+            return it->second;
+
+        EnumPlan* plan = new EnumPlan();
+        plan->descriptor = descriptor;
+        plan->frozen = LUA_NOREF;
+        m_enums[descriptor] = plan;
+
+        lua_createtable(L, 0, descriptor->value_count());
+        lua_createtable(L, 0, descriptor->value_count());
+        for (int i = 0; i < descriptor->value_count(); ++i) {
+            const EnumValueDescriptor* value = descriptor->value(i);
+            lua_pushlstring(L, value->name().data(), value->name().size());
+            lua_pushinteger(L, value->number());
+            lua_rawset(L, -4);
+            if (lua_rawgeti(L, -1, value->number()) == LUA_TNIL) {
+                lua_pushlstring(L, value->name().data(), value->name().size());
+                lua_rawseti(L, -3, value->number());
+            }
+            lua_pop(L, 1);
+        }
+        plan->names = luaL_ref(L, LUA_REGISTRYINDEX);
+        plan->values = luaL_ref(L, LUA_REGISTRYINDEX);
+        return plan;
+    }
+
+    template <int TYPE>
+    bool ScriptProtobuf::value_lua2wire(lua_State* L, int index, const FieldPlan& field, std::string& out, bool* zero) {
+        switch (TYPE) {
+        case FieldDescriptor::TYPE_DOUBLE: {
+            double v = lua_tonumber(L, index);
+            wire_fixed64(out, WireFormatLite::EncodeDouble(v));
+            *zero = (v == 0);
+            break;
+        }
+        case FieldDescriptor::TYPE_FLOAT: {
+            float v = static_cast<float>(lua_tonumber(L, index));
+            wire_fixed32(out, WireFormatLite::EncodeFloat(v));
+            *zero = (v == 0);
+            break;
+        }
+        case FieldDescriptor::TYPE_INT64:
+        case FieldDescriptor::TYPE_UINT64: {
+            int64 v = lua_toint64(L, index);
+            wire_varint(out, static_cast<uint64>(v));
+            *zero = (v == 0);
+            break;
+        }
+        case FieldDescriptor::TYPE_INT32: {
+            int32 v = static_cast<int32>(lua_toint64(L, index));
+            wire_varint(out, static_cast<uint64>(static_cast<int64>(v)));
+            *zero = (v == 0);
+            break;
+        }
+        case FieldDescriptor::TYPE_UINT32: {
+            uint32 v = static_cast<uint32>(lua_toint64(L, index));
+            wire_varint(out, v);
+            *zero = (v == 0);
+            break;
+        }
+        case FieldDescriptor::TYPE_SINT32: {
+            int32 v = static_cast<int32>(lua_toint64(L, index));
+            wire_varint(out, WireFormatLite::ZigZagEncode32(v));
+            *zero = (v == 0);
+            break;
+        }
+        case FieldDescriptor::TYPE_SINT64: {
+            int64 v = lua_toint64(L, index);
+            wire_varint(out, WireFormatLite::ZigZagEncode64(v));
+            *zero = (v == 0);
+            break;
+        }
+        case FieldDescriptor::TYPE_FIXED32:
+        case FieldDescriptor::TYPE_SFIXED32: {
+            uint32 v = static_cast<uint32>(lua_toint64(L, index));
+            wire_fixed32(out, v);
+            *zero = (v == 0);
+            break;
+        }
+        case FieldDescriptor::TYPE_FIXED64:
+        case FieldDescriptor::TYPE_SFIXED64: {
+            uint64 v = static_cast<uint64>(lua_toint64(L, index));
+            wire_fixed64(out, v);
+            *zero = (v == 0);
+            break;
+        }
+        case FieldDescriptor::TYPE_BOOL: {
+            bool v = lua_toboolean(L, index) != 0;
+            wire_varint(out, v ? 1 : 0);
+            *zero = !v;
+            break;
+        }
+        case FieldDescriptor::TYPE_ENUM: {
+            const EnumDescriptor* enumDescriptor = field.fd->enum_type();
+            int32_t               n = 0;
+            if (lua_type(L, index) == LUA_TSTRING) {
+                // the name string is the key, no std::string is built
+                lua_rawgeti(L, LUA_REGISTRYINDEX, field.enumeration->values);
+                lua_pushvalue(L, index);
+                bool found = lua_rawget(L, -2) == LUA_TNUMBER;
+                n = static_cast<int32_t>(lua_tointeger(L, -1));
+                lua_pop(L, 2);
+                if (!found) {
+                    PRINTF("cant find enum name %s:%s \n", enumDescriptor->name().c_str(), lua_tostring(L, index));
+                    return false;
+                }
+            }
+            else {
+                n = static_cast<int32_t>(lua_toint64(L, index));
+                if (!enumDescriptor->FindValueByNumber(n)) {
+                    PRINTF("cant find enum number %s:%d \n", enumDescriptor->name().c_str(), n);
+                    return false;
                 }
             }
+            wire_varint(out, static_cast<uint64>(static_cast<int64>(n)));
+            *zero = (n == 0);
+            break;
         }
-        return message;
+        case FieldDescriptor::TYPE_STRING:
+        case FieldDescriptor::TYPE_BYTES: {
+            size_t      len = 0;
+            const char* s = lua_tobuffer(L, index, &len);
+            if (!s) {
+                PRINTF("field %s expect string got %s \n", field.fd->name().c_str(), luaL_typename(L, index));
+                return false;
+            }
+            wire_varint(out, len);
+            out.append(s, len);
+            *zero = (len == 0);
+            break;
+        }
+        case FieldDescriptor::TYPE_MESSAGE: {
+            if (lua_type(L, index) != LUA_TTABLE) {
+                PRINTF("convert to message %s failed whith value %s \n", field.message->descriptor->full_name().c_str(), field.fd->name().c_str());
+                return false;
+            }
+            size_t start = out.size();
+            out.push_back(0);
+            if (!lua2wire(L, index, *field.message, out))
+                return false;
+            wire_patch_length(out, start);
+            *zero = false;
+            break;
+        }
+        case FieldDescriptor::TYPE_GROUP: {
+            // no length, the fields run up to the END_GROUP tag
+            if (lua_type(L, index) != LUA_TTABLE) {
+                PRINTF("convert to message %s failed whith value %s \n", field.message->descriptor->full_name().c_str(), field.fd->name().c_str());
+                return false;
+            }
+            if (!lua2wire(L, index, *field.message, out))
+                return false;
+            wire_varint(out, WireFormatLite::MakeTag(field.fd->number(), WireFormatLite::WIRETYPE_END_GROUP));
+            *zero = false;
+            break;
+        }
+        default: {
+            PRINTF("UNKNOWN FIELD TYPE %d", field.fd->type());
+            return false;
+        }
+        }  // switch
+        return true;
+    }
+
+    bool ScriptProtobuf::single_field_lua2wire(lua_State* L, int index, const FieldPlan& field, std::string& out) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, field.key);
+        if (field.required)
+            lua_gettable(L, index);  // through the defaults metatable, a required field is never unset
+        else
+            encode_field_get(L, index);
+        if (lua_isnil(L, -1)) {
+            lua_pop(L, 1);
+            if (field.required) {
+                PRINTF("lose required field %s", field.fd->name().c_str());
+                return false;
+            }
+            return true;
+        }
+
+        size_t start = out.size();
+        bool   zero = false;
+        out.append(reinterpret_cast<const char*>(field.tag), field.tag_size);
+        bool ok = (this->*field.encode)(L, lua_gettop(L), field, out, &zero);
+        lua_pop(L, 1);
+
+        if (ok && zero && field.skip_zero)
+            out.resize(start);
+        return ok;
+    }
+
+    // lua table -> array
+    bool ScriptProtobuf::repeated_field_lua2wire(lua_State* L, int index, const FieldPlan& field, std::string& out) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, field.key);
+        encode_field_get(L, index);
+        if (lua_type(L, -1) != LUA_TTABLE) {
+            lua_pop(L, 1);
+            return true;
+        }
+
+        int    array = lua_gettop(L);
+        size_t size = lua_rawlen(L, array);
+        bool   zero = false;
+        bool   ok = true;
+        if (field.kind == FIELD_PACKED) {
+            if (size > 0 && field.packed_encode) {
+                out.append(reinterpret_cast<const char*>(field.tag), field.tag_size);
+                (this->*field.packed_encode)(L, array, size, out);
+            }
+            else if (size > 0) {
+                out.append(reinterpret_cast<const char*>(field.tag), field.tag_size);
+                size_t start = out.size();
+                out.push_back(0);
+                for (size_t i = 1; ok && i <= size; i++) {
+                    lua_rawgeti(L, array, i);
+                    ok = (this->*field.encode)(L, array + 1, field, out, &zero);
+                    lua_pop(L, 1);
+                }
+                wire_patch_length(out, start);
+            }
+        }
+        else {
+            for (size_t i = 1; ok && i <= size; i++) {
+                out.append(reinterpret_cast<const char*>(field.tag), field.tag_size);
+                lua_rawgeti(L, array, i);
+                ok = (this->*field.encode)(L, array + 1, field, out, &zero);
+                lua_pop(L, 1);
+            }
+        }
+        lua_pop(L, 1);
+        return ok;
+    }
+
+    // lua table -> map entries, key = 1 value = 2
+    bool ScriptProtobuf::map_field_lua2wire(lua_State* L, int index, const FieldPlan& field, std::string& out) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, field.key);
+        encode_field_get(L, index);
+        if (lua_type(L, -1) != LUA_TTABLE) {
+            lua_pop(L, 1);
+            return true;
+        }
+
+        int              map = lua_gettop(L);
+        const FieldPlan& key = field.message->fields[0];
+        const FieldPlan& value = field.message->fields[1];
+        bool             zero = false;
+        // lua_tolstring must not touch the key lua_next uses, numeric keys are read in place
+        bool copy_key = key.fd->cpp_type() == FieldDescriptor::CPPTYPE_STRING;
+
+        lua_pushnil(L);
+        while (lua_next(L, map)) {
+            lua_pushvalue(L, copy_key ? map + 1 : map + 2);
+
+            out.append(reinterpret_cast<const char*>(field.tag), field.tag_size);
+            size_t start = out.size();
+            out.push_back(0);
+            out.append(reinterpret_cast<const char*>(key.tag), key.tag_size);
+            bool ok = (this->*key.encode)(L, copy_key ? map + 3 : map + 1, key, out, &zero);
+            if (ok) {
+                out.append(reinterpret_cast<const char*>(value.tag), value.tag_size);
+                ok = (this->*value.encode)(L, map + 2, value, out, &zero);
+            }
+            if (!ok) {
+                PRINTF("(lua map error) key=%s \n", luaL_tolstring(L, copy_key ? map + 3 : map + 1, nullptr));
+                lua_settop(L, map - 1);
+                return false;
+            }
+            wire_patch_length(out, start);
+            lua_pop(L, 2);
+        }
+        lua_pop(L, 1);
+        return true;
+    }
+
+    bool ScriptProtobuf::field_lua2wire(lua_State* L, int index, const FieldPlan& field, std::string& out) {
+        switch (field.kind) {
+        case FIELD_MAP:
+            return map_field_lua2wire(L, index, field, out);
+        case FIELD_REPEATED:
+        case FIELD_PACKED:
+            return repeated_field_lua2wire(L, index, field, out);
+        default:
+            return single_field_lua2wire(L, index, field, out);
+        }
+    }
+
+    bool ScriptProtobuf::lua2wire(lua_State* L, int index, const MessagePlan& plan, std::string& out) {
+        if (!lua_checkstack(L, LUA_MINSTACK)) {
+            PRINTF("lua stack overflow encoding %s \n", plan.descriptor->full_name().c_str());
+            return false;
+        }
+
+        // fields the defaults metatable answers for are unset, the table is read raw
+        bool raw = has_defaults_metatable(L, index, plan);
+        bool saved = m_encode_raw;
+        bool dense = true;
+        m_encode_raw = raw;
+
+        // one member per oneof is encoded, a "<oneof>_case" key names it in a single lookup
+        size_t                 oneofs = plan.oneofs.size();
+        int                    inline_cases[8];
+        std::unique_ptr<int[]> heap_cases(oneofs > 8 ? new int[oneofs] : nullptr);
+        int*                   cases = heap_cases ? heap_cases.get() : inline_cases;
+        bool                   ok = oneof_cases_lua(L, index, plan, raw, cases);
+
+        // wide schemas try the table's own keys first, a metatable may supply fields lua_next cannot see
+        if (ok && plan.fields.size() >= kSparseFields && (raw || !lua_getmetatable(L, index))) {
+            dense = false;
+            ok = sparse_lua2wire(L, index, plan, cases, out, &dense);
+        }
+        else if (ok && plan.fields.size() >= kSparseFields) {
+            lua_pop(L, 1);
+        }
+
+        for (size_t i = 0; ok && dense && i < plan.fields.size(); ++i) {
+            const FieldPlan& field = plan.fields[i];
+            if (field.oneof >= 0 && cases[field.oneof] != static_cast<int>(i))
+                continue;
+            ok = field_lua2wire(L, index, field, out);
+        }
+        m_encode_raw = saved;
+        return ok;
+    }
+
+    // the member of each oneof to encode: the one its "<oneof>_case" key names; without a key, or when the
+    // key names a member the table does not hold, the last member set, as SetXxx leaves it on the reflection path;
+    // -1 where no member is set
+    bool ScriptProtobuf::oneof_cases_lua(lua_State* L, int index, const MessagePlan& plan, bool raw, int* cases) {
+        auto held = [&](int slot) {
+            lua_rawgeti(L, LUA_REGISTRYINDEX, plan.fields[slot].key);
+            if (raw)
+                lua_rawget(L, index);
+            else
+                lua_gettable(L, index);
+            bool set = !lua_isnil(L, -1);
+            lua_pop(L, 1);
+            return set;
+        };
+
+        for (size_t i = 0; i < plan.oneofs.size(); ++i) {
+            cases[i] = -1;
+            lua_rawgeti(L, LUA_REGISTRYINDEX, plan.oneofs[i].key);
+            if (raw)
+                lua_rawget(L, index);
+            else
+                lua_gettable(L, index);
+            if (!lua_isnil(L, -1)) {
+                lua_rawgeti(L, LUA_REGISTRYINDEX, plan.names);
+                lua_pushvalue(L, -2);
+                lua_Integer slot = lua_type(L, -1) == LUA_TSTRING && lua_rawget(L, -2) == LUA_TNUMBER ? lua_tointeger(L, -1) - 1 : -1;
+                if (slot < 0 || plan.fields[slot].oneof != static_cast<int>(i)) {
+                    PRINTF("%s_case is not a member of %s: %s\n", plan.descriptor->oneof_decl(static_cast<int>(i))->name().c_str(),
+                        plan.descriptor->full_name().c_str(), luaL_tolstring(L, -3, nullptr));
+                    lua_pop(L, 4);
+                    return false;
+                }
+                lua_pop(L, 2);
+                if (held(static_cast<int>(slot)))
+                    cases[i] = static_cast<int>(slot);
+            }
+            lua_pop(L, 1);
+
+            for (size_t j = 0; cases[i] < 0 && j < plan.oneofs[i].slots.size(); ++j) {
+                int slot = plan.oneofs[i].slots[plan.oneofs[i].slots.size() - 1 - j];
+                if (held(slot))
+                    cases[i] = slot;
+            }
+        }
+        return true;
+    }
+
+    void ScriptProtobuf::encode_field_get(lua_State* L, int index) {
+        if (m_encode_raw)
+            lua_rawget(L, index);
+        else
+            lua_gettable(L, index);
+    }
+
+    // encodes only the fields the table sets, in field number order. Gives up with *dense set once
+    // the table holds more than a quarter of the fields, or misses a required one, before writing
+    bool ScriptProtobuf::sparse_lua2wire(lua_State* L, int index, const MessagePlan& plan, const int* cases, std::string& out, bool* dense) {
+        size_t limit = std::min(plan.fields.size() / 4, kSparseSlots);
+        int    slots[kSparseSlots];
+        size_t count = 0;
+        int    required = 0;
+
+        lua_rawgeti(L, LUA_REGISTRYINDEX, plan.names);
+        int names = lua_gettop(L);
+        lua_pushnil(L);
+        while (lua_next(L, index)) {
+            lua_pop(L, 1);
+            if (lua_type(L, -1) != LUA_TSTRING)
+                continue;
+            lua_pushvalue(L, -1);
+            if (lua_rawget(L, names) == LUA_TNUMBER) {
+                if (count == limit) {
+                    lua_settop(L, names - 1);
+                    *dense = true;
+                    return true;
+                }
+                int slot = static_cast<int>(lua_tointeger(L, -1)) - 1;
+                slots[count++] = slot;
+                if (plan.fields[slot].required)
+                    required++;
+            }
+            lua_pop(L, 1);
+        }
+        lua_pop(L, 1);
+
+        if (required < plan.required) {
+            *dense = true;
+            return true;
+        }
+
+        std::sort(slots, slots + count);
+        for (size_t i = 0; i < count; ++i) {
+            const FieldPlan& field = plan.fields[slots[i]];
+            if (field.oneof >= 0 && cases[field.oneof] != slots[i])
+                continue;
+            if (!field_lua2wire(L, index, field, out))
+                return false;
+        }
+        return true;
     }
 
-    bool ScriptProtobuf::map_field_pb2lua(const Message& message, const Reflection* reflection, const FieldDescriptor* fd, sol::table& sub) {
+    // the table at index gets one key per map entry
+    bool ScriptProtobuf::map_field_pb2lua(lua_State* L, int index, const Message& message, const Reflection* reflection, const FieldDescriptor* fd) {
         int size = reflection->FieldSize(message, fd);
         for (int i = 0; i < size; ++i) {
             if (fd->cpp_type() != FieldDescriptor::CPPTYPE_MESSAGE)
@@ -589,203 +2932,1529 @@ namespace lua_module {
             auto  value = desc->field(1);
             switch (key->cpp_type()) {
             case FieldDescriptor::CPPTYPE_DOUBLE:
-                single_field_pb2lua(msg, ref, value, sub, (int64_t)ref->GetDouble(msg, key));  // Key in map fields cannot be float/double, bytes or message types.
+                lua_pushinteger(L, (int64_t)ref->GetDouble(msg, key));  // Key in map fields cannot be float/double, bytes or message types.
                 break;
             case FieldDescriptor::CPPTYPE_FLOAT:
-                single_field_pb2lua(msg, ref, value, sub, (int64_t)ref->GetFloat(msg, key));
+                lua_pushinteger(L, (int64_t)ref->GetFloat(msg, key));
                 break;
             case FieldDescriptor::CPPTYPE_INT64:
-                single_field_pb2lua(msg, ref, value, sub, ref->GetInt64(msg, key));
+                lua_pushinteger(L, ref->GetInt64(msg, key));
                 break;
             case FieldDescriptor::CPPTYPE_UINT64:
-                single_field_pb2lua(msg, ref, value, sub, ref->GetUInt64(msg, key));
+                lua_pushuint64(L, ref->GetUInt64(msg, key));
                 break;
             case FieldDescriptor::CPPTYPE_ENUM:
-                single_field_pb2lua(msg, ref, value, sub, ref->GetEnum(msg, key)->number());
+                lua_pushinteger(L, ref->GetEnum(msg, key)->number());
                 break;
             case FieldDescriptor::CPPTYPE_INT32:
-                single_field_pb2lua(msg, ref, value, sub, ref->GetInt32(msg, key));
+                lua_pushinteger(L, ref->GetInt32(msg, key));
                 break;
             case FieldDescriptor::CPPTYPE_UINT32:
-                single_field_pb2lua(msg, ref, value, sub, ref->GetUInt32(msg, key));
+                lua_pushinteger(L, ref->GetUInt32(msg, key));
                 break;
-            case FieldDescriptor::CPPTYPE_STRING:
-                single_field_pb2lua(msg, ref, value, sub, ref->GetString(msg, key));
+            case FieldDescriptor::CPPTYPE_STRING: {
+                const std::string& s = ref->GetStringReference(msg, key, nullptr);
+                lua_pushlstring(L, s.data(), s.size());
                 break;
+            }
             case FieldDescriptor::CPPTYPE_BOOL:
-                single_field_pb2lua(msg, ref, value, sub, ref->GetBool(msg, key));
+                lua_pushboolean(L, ref->GetBool(msg, key));
                 break;
             default:
                 PRINTF("unknown key type: %d", key->cpp_type());
                 return false;
             }
+            if (single_field_pb2lua(L, msg, ref, value))
+                lua_rawset(L, index);
+            else
+                lua_pop(L, 1);
         }
         return true;
     }
 
-    bool ScriptProtobuf::repeated_field_pb2lua(const Message& message, const Reflection* reflection, const FieldDescriptor* fd, sol::table& sub) {
+    // the table at index gets the elements 1..n
+    bool ScriptProtobuf::repeated_field_pb2lua(lua_State* L, int index, const Message& message, const Reflection* reflection, const FieldDescriptor* fd) {
         int size = reflection->FieldSize(message, fd);
         for (int i = 0; i < size; ++i) {
             switch (fd->cpp_type()) {
             case FieldDescriptor::CPPTYPE_DOUBLE:
-                sub.add(reflection->GetRepeatedDouble(message, fd, i));
+                lua_pushnumber(L, reflection->GetRepeatedDouble(message, fd, i));
                 break;
             case FieldDescriptor::CPPTYPE_FLOAT:
-                sub.add(reflection->GetRepeatedFloat(message, fd, i));
+                lua_pushnumber(L, reflection->GetRepeatedFloat(message, fd, i));
                 break;
             case FieldDescriptor::CPPTYPE_INT64:
-                sub.add(reflection->GetRepeatedInt64(message, fd, i));
+                lua_pushinteger(L, reflection->GetRepeatedInt64(message, fd, i));
                 break;
             case FieldDescriptor::CPPTYPE_UINT64:
-                sub.add(reflection->GetRepeatedUInt64(message, fd, i));
+                lua_pushuint64(L, reflection->GetRepeatedUInt64(message, fd, i));
                 break;
             case FieldDescriptor::CPPTYPE_ENUM:
-                sub.add(reflection->GetRepeatedEnum(message, fd, i)->number());
+                lua_pushinteger(L, reflection->GetRepeatedEnum(message, fd, i)->number());
                 break;
             case FieldDescriptor::CPPTYPE_INT32:
-                sub.add(reflection->GetRepeatedInt32(message, fd, i));
+                lua_pushinteger(L, reflection->GetRepeatedInt32(message, fd, i));
                 break;
             case FieldDescriptor::CPPTYPE_UINT32:
-                sub.add(reflection->GetRepeatedUInt32(message, fd, i));
+                lua_pushinteger(L, reflection->GetRepeatedUInt32(message, fd, i));
                 break;
             case FieldDescriptor::CPPTYPE_STRING: {
-                sub.add(reflection->GetRepeatedString(message, fd, i));
+                const std::string& s = reflection->GetRepeatedStringReference(message, fd, i, nullptr);
+                lua_pushlstring(L, s.data(), s.size());
                 break;
             }
             case FieldDescriptor::CPPTYPE_BOOL:
-                sub.add(reflection->GetRepeatedBool(message, fd, i));
+                lua_pushboolean(L, reflection->GetRepeatedBool(message, fd, i));
                 break;
             case FieldDescriptor::CPPTYPE_MESSAGE: {
-                sol::state_view lua(m_nil_object.lua_state());
-                auto            ext = lua.create_table();
-                auto&           msg = reflection->GetRepeatedMessage(message, fd, i);
-                protobuf2lua(msg, ext);
-                sub.add(ext);
+                auto& msg = reflection->GetRepeatedMessage(message, fd, i);
+                lua_createtable(L, 0, msg.GetDescriptor()->field_count());
+                protobuf2lua(L, lua_gettop(L), msg);
                 break;
             }
             default:
                 PRINTF("unknown type: %d", fd->cpp_type());
-                break;
+                continue;
             }
+            lua_rawseti(L, index, i + 1);
         }
         return true;
     }
-    template <typename T>
-    bool ScriptProtobuf::single_field_pb2lua(const Message& message, const Reflection* reflection, const FieldDescriptor* fd, sol::table& dest, const T& name) {
+
+    // pushes the value of a singular field, nothing when its type is unknown
+    bool ScriptProtobuf::single_field_pb2lua(lua_State* L, const Message& message, const Reflection* reflection, const FieldDescriptor* fd) {
         switch (fd->cpp_type()) {
         case FieldDescriptor::CPPTYPE_DOUBLE:
-            dest[name] = reflection->GetDouble(message, fd);
+            lua_pushnumber(L, reflection->GetDouble(message, fd));
             break;
         case FieldDescriptor::CPPTYPE_FLOAT:
-            dest[name] = reflection->GetFloat(message, fd);
+            lua_pushnumber(L, reflection->GetFloat(message, fd));
             break;
         case FieldDescriptor::CPPTYPE_INT64:
-            dest[name] = reflection->GetInt64(message, fd);
+            lua_pushinteger(L, reflection->GetInt64(message, fd));
             break;
         case FieldDescriptor::CPPTYPE_UINT64:
-            dest[name] = reflection->GetUInt64(message, fd);
+            lua_pushuint64(L, reflection->GetUInt64(message, fd));
             break;
         case FieldDescriptor::CPPTYPE_ENUM:
-            dest[name] = (int)reflection->GetEnum(message, fd)->number();
+            lua_pushinteger(L, reflection->GetEnum(message, fd)->number());
             break;
         case FieldDescriptor::CPPTYPE_INT32:
-            dest[name] = reflection->GetInt32(message, fd);
+            lua_pushinteger(L, reflection->GetInt32(message, fd));
             break;
         case FieldDescriptor::CPPTYPE_UINT32:
-            dest[name] = reflection->GetUInt32(message, fd);
+            lua_pushinteger(L, reflection->GetUInt32(message, fd));
             break;
-        case FieldDescriptor::CPPTYPE_STRING:
-            dest[name] = reflection->GetString(message, fd);
+        case FieldDescriptor::CPPTYPE_STRING: {
+            const std::string& s = reflection->GetStringReference(message, fd, nullptr);
+            lua_pushlstring(L, s.data(), s.size());
             break;
+        }
         case FieldDescriptor::CPPTYPE_BOOL:
-            dest[name] = reflection->GetBool(message, fd);
+            lua_pushboolean(L, reflection->GetBool(message, fd));
             break;
         case FieldDescriptor::CPPTYPE_MESSAGE: {
-            sol::state_view lua(m_nil_object.lua_state());
-            sol::table      ext = lua.create_table();
-            auto&           msg = reflection->GetMessage(message, fd);
-            protobuf2lua(msg, ext);
-            dest[name] = ext;
+            auto& msg = reflection->GetMessage(message, fd);
+            lua_createtable(L, 0, msg.GetDescriptor()->field_count());
+            protobuf2lua(L, lua_gettop(L), msg);
             break;
         }
         default:
             PRINTF("unknown type: %d", fd->cpp_type());
-            break;
+            return false;
         }
         return true;
     }
 
-    void ScriptProtobuf::protobuf2lua(const Message& message, sol::table& root) {
-        const Reflection* reflection = message.GetReflection();
-        const Descriptor* descriptor = message.GetDescriptor();
-        sol::state_view   lua(m_nil_object.lua_state());
+    // fills the table at index, each key is pushed from the plan and raw set with its value
+    void ScriptProtobuf::protobuf2lua(lua_State* L, int index, const Message& message) {
+        const Reflection*  reflection = message.GetReflection();
+        const MessagePlan* plan = message_plan(L, message.GetDescriptor());
+        if (!lua_checkstack(L, LUA_MINSTACK)) {
+            PRINTF("lua stack overflow decoding %s \n", message.GetTypeName().c_str());
+            return;
+        }
+
+        for (const FieldPlan& field : plan->fields) {
+            const FieldDescriptor* fd = field.fd;
 
-        for (int32_t index = 0; index < descriptor->field_count(); ++index) {
-            const FieldDescriptor* fd = descriptor->field(index);
-            const std::string&     name = fd->name();
+            // only the oneof member that is set
+            if (field.oneof >= 0 && !reflection->HasField(message, fd))
+                continue;
+
+            // interned key from the plan, stays pushed while the field is set
+            lua_rawgeti(L, LUA_REGISTRYINDEX, field.key);
 
             if (fd->is_repeated()) {
-                auto sub = lua.create_table();
+                int size = reflection->FieldSize(message, fd);
                 if (fd->is_map()) {
-                    if (map_field_pb2lua(message, reflection, fd, sub))
-                        root[name] = sub;
+                    lua_createtable(L, 0, size);
+                    map_field_pb2lua(L, lua_gettop(L), message, reflection, fd);
                 }
                 else {
-                    if (repeated_field_pb2lua(message, reflection, fd, sub))
-                        root[name] = sub;
+                    lua_createtable(L, size, 0);
+                    repeated_field_pb2lua(L, lua_gettop(L), message, reflection, fd);
                 }
-
+                lua_rawset(L, index);
+            }
+            else if (field.message && !reflection->HasField(message, fd)) {
+                // the default wire2lua gives, the default instance of a self-referential type never ends
+                default_field2lua(L, field);
+                lua_rawset(L, index);
+            }
+            else if (single_field_pb2lua(L, message, reflection, fd)) {
+                lua_rawset(L, index);
             }
             else {
-                single_field_pb2lua(message, reflection, fd, root, name);
+                lua_pop(L, 1);
             }
         }
     }
-#ifdef PRIVATE_REQUIRE
-    // register to a table
-    static sol::table require_api(sol::this_state L) {
-        sol::state_view lua(L);
-
-        sol::table module = lua.create_table();
-        module.new_usertype<ScriptProtobuf>("pb",
-            sol::constructors<ScriptProtobuf(sol::this_state, const std::string&)>(),
-            "encode",
-            &ScriptProtobuf::Encode,
-            "decode",
-            &ScriptProtobuf::Decode,
-            "get_enum",
-            &ScriptProtobuf::GetEnum,
-            "get_message",
-            &ScriptProtobuf::GetStruct);
-
-        return module;
-    }
-}
-// lua require
-LUA_API int luaopen_luapb(lua_State* L) {
-    return sol::stack::call_lua(L, 1, lua_module::require_api);
-}
-
-// c++ register
-LUA_API int require_luapb(lua_State* L) {
-    luaL_requiref(L, "luapb", luaopen_luapb, 0);
-    PRINTF("lua module: require luapb\n");
-    return 1;
-}
-
-#else
-    //register to public
-    static int require_api(sol::state_view lua) {
+    template <int TYPE>
+    bool ScriptProtobuf::value_wire2lua(lua_State* L, const FieldPlan& field, io::CodedInputStream& input) {
+        switch (TYPE) {
+        case FieldDescriptor::TYPE_DOUBLE: {
+            uint64 v = 0;
+            if (!input.ReadLittleEndian64(&v))
+                return false;
+            lua_pushnumber(L, WireFormatLite::DecodeDouble(v));
+            break;
+        }
+        case FieldDescriptor::TYPE_FLOAT: {
+            uint32 v = 0;
+            if (!input.ReadLittleEndian32(&v))
+                return false;
+            lua_pushnumber(L, WireFormatLite::DecodeFloat(v));
+            break;
+        }
+        case FieldDescriptor::TYPE_INT64: {
+            uint64 v = 0;
+            if (!input.ReadVarint64(&v))
+                return false;
+            lua_pushinteger(L, static_cast<int64>(v));
+            break;
+        }
+        case FieldDescriptor::TYPE_INT32: {
+            uint64 v = 0;
+            if (!input.ReadVarint64(&v))
+                return false;
+            lua_pushinteger(L, static_cast<int32>(v));
+            break;
+        }
+        case FieldDescriptor::TYPE_UINT64: {
+            uint64 v = 0;
+            if (!input.ReadVarint64(&v))
+                return false;
+            lua_pushuint64(L, v);
+            break;
+        }
+        case FieldDescriptor::TYPE_UINT32: {
+            uint32 v = 0;
+            if (!input.ReadVarint32(&v))
+                return false;
+            lua_pushinteger(L, v);
+            break;
+        }
+        case FieldDescriptor::TYPE_SINT32: {
+            uint32 v = 0;
+            if (!input.ReadVarint32(&v))
+                return false;
+            lua_pushinteger(L, WireFormatLite::ZigZagDecode32(v));
+            break;
+        }
+        case FieldDescriptor::TYPE_SINT64: {
+            uint64 v = 0;
+            if (!input.ReadVarint64(&v))
+                return false;
+            lua_pushinteger(L, WireFormatLite::ZigZagDecode64(v));
+            break;
+        }
+        case FieldDescriptor::TYPE_FIXED32: {
+            uint32 v = 0;
+            if (!input.ReadLittleEndian32(&v))
+                return false;
+            lua_pushinteger(L, v);
+            break;
+        }
+        case FieldDescriptor::TYPE_SFIXED32: {
+            uint32 v = 0;
+            if (!input.ReadLittleEndian32(&v))
+                return false;
+            lua_pushinteger(L, static_cast<int32>(v));
+            break;
+        }
+        case FieldDescriptor::TYPE_FIXED64: {
+            uint64 v = 0;
+            if (!input.ReadLittleEndian64(&v))
+                return false;
+            lua_pushuint64(L, v);
+            break;
+        }
+        case FieldDescriptor::TYPE_SFIXED64: {
+            uint64 v = 0;
+            if (!input.ReadLittleEndian64(&v))
+                return false;
+            lua_pushinteger(L, static_cast<int64>(v));
+            break;
+        }
+        case FieldDescriptor::TYPE_BOOL: {
+            uint64 v = 0;
+            if (!input.ReadVarint64(&v))
+                return false;
+            lua_pushboolean(L, v != 0);
+            break;
+        }
+        case FieldDescriptor::TYPE_ENUM: {
+            uint64 v = 0;
+            if (!input.ReadVarint64(&v))
+                return false;
+            int n = static_cast<int>(v);
+            // proto2 keeps unknown enum numbers out of the message, pushed as nil and dropped;
+            // by name, a proto3 number the enum does not declare stays a number
+            if (m_decode.enum_names) {
+                lua_rawgeti(L, LUA_REGISTRYINDEX, field.enumeration->names);
+                if (lua_rawgeti(L, -1, n) == LUA_TNIL && field.proto3) {
+                    lua_pop(L, 1);
+                    lua_pushinteger(L, n);
+                }
+                lua_remove(L, -2);
+            }
+            else if (!field.proto3 && !field.fd->enum_type()->FindValueByNumber(n))
+                lua_pushnil(L);
+            else
+                lua_pushinteger(L, n);
+            break;
+        }
+        case FieldDescriptor::TYPE_STRING:
+        case FieldDescriptor::TYPE_BYTES: {
+            uint32      len = 0;
+            const void* data = nullptr;
+            int         size = 0;
+            if (!input.ReadVarint32(&len))
+                return false;
+            if (TYPE == FieldDescriptor::TYPE_BYTES && m_decode.bytes_slice) {
+                if (len > 0 && (!input.GetDirectBufferPointer(&data, &size) || static_cast<uint32>(size) < len))
+                    return false;
+                lua_pushslice(L, static_cast<const char*>(data), len, m_decode.source);
+                input.Skip(static_cast<int>(len));
+                break;
+            }
+            if (len == 0) {
+                lua_pushliteral(L, "");
+                break;
+            }
+            if (!input.GetDirectBufferPointer(&data, &size) || static_cast<uint32>(size) < len)
+                return false;
+            lua_pushlstring(L, static_cast<const char*>(data), len);
+            input.Skip(static_cast<int>(len));
+            break;
+        }
+        case FieldDescriptor::TYPE_GROUP:
+        case FieldDescriptor::TYPE_MESSAGE: {
+            lua_createtable(L, 0, table_size2lua(*field.message));
+            if (!nested_wire2lua(L, lua_gettop(L), field, input, DECODE_NEW))
+                return false;
+            break;
+        }
+        default:
+            PRINTF("unknown type: %d", field.fd->type());
+            return false;
+        }
+        return true;
+    }
+
+    // packed block of a numeric type: values are converted straight from the lua array into a
+    // buffer sized once, fixed width types have their exact length, varints are written into the
+    // worst case and trimmed
+    template <int TYPE>
+    void ScriptProtobuf::packed_lua2wire(lua_State* L, int array, size_t size, std::string& out) {
+        const bool fixed32 = TYPE == FieldDescriptor::TYPE_FLOAT || TYPE == FieldDescriptor::TYPE_FIXED32 || TYPE == FieldDescriptor::TYPE_SFIXED32;
+        const bool fixed64 = TYPE == FieldDescriptor::TYPE_DOUBLE || TYPE == FieldDescriptor::TYPE_FIXED64 || TYPE == FieldDescriptor::TYPE_SFIXED64;
+
+        if (fixed32 || fixed64) {
+            size_t len = size * (fixed32 ? 4 : 8);
+            wire_varint(out, len);
+            size_t start = out.size();
+            out.resize(start + len);
+            uint8* p = reinterpret_cast<uint8*>(&out[start]);
+            for (size_t i = 1; i <= size; ++i) {
+                lua_rawgeti(L, array, static_cast<lua_Integer>(i));
+                switch (TYPE) {
+                case FieldDescriptor::TYPE_FLOAT:
+                    p = io::CodedOutputStream::WriteLittleEndian32ToArray(WireFormatLite::EncodeFloat(static_cast<float>(lua_tonumber(L, -1))), p);
+                    break;
+                case FieldDescriptor::TYPE_DOUBLE:
+                    p = io::CodedOutputStream::WriteLittleEndian64ToArray(WireFormatLite::EncodeDouble(lua_tonumber(L, -1)), p);
+                    break;
+                case FieldDescriptor::TYPE_FIXED32:
+                case FieldDescriptor::TYPE_SFIXED32:
+                    p = io::CodedOutputStream::WriteLittleEndian32ToArray(static_cast<uint32>(lua_toint64(L, -1)), p);
+                    break;
+                default:
+                    p = io::CodedOutputStream::WriteLittleEndian64ToArray(static_cast<uint64>(lua_toint64(L, -1)), p);
+                    break;
+                }
+                lua_pop(L, 1);
+            }
+            return;
+        }
+
+        size_t start = out.size();
+        out.push_back(0);
+        size_t body = out.size();
+        out.resize(body + size * (TYPE == FieldDescriptor::TYPE_BOOL ? 1 : kMaxVarintBytes));
+        uint8* begin = reinterpret_cast<uint8*>(&out[body]);
+        uint8* p = begin;
+        for (size_t i = 1; i <= size; ++i) {
+            lua_rawgeti(L, array, static_cast<lua_Integer>(i));
+            uint64 v = 0;
+            switch (TYPE) {
+            case FieldDescriptor::TYPE_BOOL:
+                v = lua_toboolean(L, -1) ? 1 : 0;
+                break;
+            case FieldDescriptor::TYPE_INT32:
+                v = static_cast<uint64>(static_cast<int64>(static_cast<int32>(lua_toint64(L, -1))));
+                break;
+            case FieldDescriptor::TYPE_UINT32:
+                v = static_cast<uint32>(lua_toint64(L, -1));
+                break;
+            case FieldDescriptor::TYPE_SINT32:
+                v = WireFormatLite::ZigZagEncode32(static_cast<int32>(lua_toint64(L, -1)));
+                break;
+            case FieldDescriptor::TYPE_SINT64:
+                v = WireFormatLite::ZigZagEncode64(lua_toint64(L, -1));
+                break;
+            default:
+                v = static_cast<uint64>(lua_toint64(L, -1));
+                break;
+            }
+            lua_pop(L, 1);
+            if (v < 0x80)
+                *p++ = static_cast<uint8>(v);
+            else
+                p = io::CodedOutputStream::WriteVarint64ToArray(v, p);
+        }
+        out.resize(body + (p - begin));
+        wire_patch_length(out, start);
+    }
+
+    // packed block of a numeric type read from the raw buffer, appended after element n
+    template <int TYPE>
+    bool ScriptProtobuf::packed_wire2lua(lua_State* L, int array, lua_Integer* n, const uint8* data, size_t size) {
+        const uint8* end = data + size;
+        lua_Integer  i = *n;
+
+        if (TYPE == FieldDescriptor::TYPE_FLOAT || TYPE == FieldDescriptor::TYPE_FIXED32 || TYPE == FieldDescriptor::TYPE_SFIXED32) {
+            if (size % 4 != 0)
+                return false;
+            for (const uint8* p = data; p < end; p += 4) {
+                uint32 v = 0;
+                io::CodedInputStream::ReadLittleEndian32FromArray(p, &v);
+                if (TYPE == FieldDescriptor::TYPE_FLOAT)
+                    lua_pushnumber(L, WireFormatLite::DecodeFloat(v));
+                else if (TYPE == FieldDescriptor::TYPE_FIXED32)
+                    lua_pushinteger(L, v);
+                else
+                    lua_pushinteger(L, static_cast<int32>(v));
+                lua_rawseti(L, array, ++i);
+            }
+        }
+        else if (TYPE == FieldDescriptor::TYPE_DOUBLE || TYPE == FieldDescriptor::TYPE_FIXED64 || TYPE == FieldDescriptor::TYPE_SFIXED64) {
+            if (size % 8 != 0)
+                return false;
+            for (const uint8* p = data; p < end; p += 8) {
+                uint64 v = 0;
+                io::CodedInputStream::ReadLittleEndian64FromArray(p, &v);
+                if (TYPE == FieldDescriptor::TYPE_DOUBLE)
+                    lua_pushnumber(L, WireFormatLite::DecodeDouble(v));
+                else if (TYPE == FieldDescriptor::TYPE_FIXED64)
+                    lua_pushuint64(L, v);
+                else
+                    lua_pushinteger(L, static_cast<int64>(v));
+                lua_rawseti(L, array, ++i);
+            }
+        }
+        else {
+            for (const uint8* p = data; p < end;) {
+                uint64 v = 0;
+                p = wire_read_varint(p, end, &v);
+                if (!p)
+                    return false;
+                switch (TYPE) {
+                case FieldDescriptor::TYPE_BOOL:
+                    lua_pushboolean(L, v != 0);
+                    break;
+                case FieldDescriptor::TYPE_INT32:
+                    lua_pushinteger(L, static_cast<int32>(v));
+                    break;
+                case FieldDescriptor::TYPE_UINT32:
+                    lua_pushinteger(L, static_cast<uint32>(v));
+                    break;
+                case FieldDescriptor::TYPE_SINT32:
+                    lua_pushinteger(L, WireFormatLite::ZigZagDecode32(static_cast<uint32>(v)));
+                    break;
+                case FieldDescriptor::TYPE_SINT64:
+                    lua_pushinteger(L, WireFormatLite::ZigZagDecode64(v));
+                    break;
+                case FieldDescriptor::TYPE_UINT64:
+                    lua_pushuint64(L, v);
+                    break;
+                default:
+                    lua_pushinteger(L, static_cast<int64>(v));
+                    break;
+                }
+                lua_rawseti(L, array, ++i);
+            }
+        }
+        *n = i;
+        return true;
+    }
+
+    // the table stored at field's key, created on first use sized by hint, left on the stack
+    void ScriptProtobuf::field_table_wire2lua(lua_State* L, int index, const FieldPlan& field, int hint) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, field.key);
+        lua_rawget(L, index);
+        if (lua_type(L, -1) != LUA_TTABLE) {
+            lua_pop(L, 1);
+            if (field.kind == FIELD_MAP)
+                lua_createtable(L, 0, hint);
+            else
+                lua_createtable(L, hint, 0);
+            lua_rawgeti(L, LUA_REGISTRYINDEX, field.key);
+            lua_pushvalue(L, -2);
+            lua_rawset(L, index);
+        }
+    }
+
+    bool ScriptProtobuf::message_wire2lua(lua_State* L, int index, const MessagePlan& plan, io::CodedInputStream& input, DecodeMode mode) {
+        uint32 len = 0;
+        if (!input.ReadVarint32(&len))
+            return false;
+        if (!input.IncrementRecursionDepth())
+            return false;
+        io::CodedInputStream::Limit limit = input.PushLimit(static_cast<int>(len));
+        if (!wire2lua(L, index, plan, input, mode))
+            return false;
+        if (!input.ConsumedEntireMessage())
+            return false;
+        input.PopLimit(limit);
+        input.DecrementRecursionDepth();
+        return true;
+    }
+
+    // the message of field, a group runs up to its own END_GROUP tag instead of a length
+    bool ScriptProtobuf::nested_wire2lua(lua_State* L, int index, const FieldPlan& field, io::CodedInputStream& input, DecodeMode mode) {
+        if (field.fd->type() != FieldDescriptor::TYPE_GROUP)
+            return message_wire2lua(L, index, *field.message, input, mode);
+        if (!input.IncrementRecursionDepth())
+            return false;
+        if (!wire2lua(L, index, *field.message, input, mode))
+            return false;
+        if (!input.LastTagWas(WireFormatLite::MakeTag(field.fd->number(), WireFormatLite::WIRETYPE_END_GROUP)))
+            return false;
+        input.DecrementRecursionDepth();
+        return true;
+    }
+
+    // one occurrence of field, a singular field seen before is merged
+    bool ScriptProtobuf::field_wire2lua(lua_State* L, int index, const FieldPlan& field, WireFormatLite::WireType type, io::CodedInputStream& input, FieldState& state, DecodeMode mode) {
+        switch (field.kind) {
+        case FIELD_MAP:
+            return map_field_wire2lua(L, index, field, input, state, mode);
+        case FIELD_REPEATED:
+        case FIELD_PACKED:
+            return repeated_field_wire2lua(L, index, field, type, input, state, mode);
+        default:
+            return single_field_wire2lua(L, index, field, input, state.seen ? DECODE_MERGE : mode);
+        }
+    }
+
+    bool ScriptProtobuf::single_field_wire2lua(lua_State* L, int index, const FieldPlan& field, io::CodedInputStream& input, DecodeMode mode) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, field.key);
+
+        // a message field seen twice is merged into the first one, a reused one is decoded in place
+        if (mode != DECODE_NEW && field.message) {
+            lua_pushvalue(L, -1);
+            lua_rawget(L, index);
+            if (lua_type(L, -1) == LUA_TTABLE) {
+                bool ok = nested_wire2lua(L, lua_gettop(L), field, input, mode);
+                lua_pop(L, 2);
+                return ok;
+            }
+            lua_pop(L, 1);
+        }
+
+        if (!(this->*field.decode)(L, field, input))
+            return false;
+        if (lua_isnil(L, -1)) {
+            // dropped enum value, the field keeps what it had or its default
+            lua_pop(L, 1);
+            if (m_decode.defaults != DEFAULTS_FILL) {
+                // left unset, a reused table loses the value of the previous decode
+                if (mode == DECODE_REUSE) {
+                    lua_pushnil(L);
+                    lua_rawset(L, index);
+                }
+                else
+                    lua_pop(L, 1);
+                return true;
+            }
+            lua_pushvalue(L, -1);
+            lua_rawget(L, index);
+            if (!lua_isnil(L, -1)) {
+                lua_pop(L, 2);
+                return true;
+            }
+            lua_pop(L, 1);
+            default_field2lua(L, field);
+        }
+        lua_rawset(L, index);
+        return true;
+    }
+
+    bool ScriptProtobuf::repeated_field_wire2lua(lua_State* L, int index, const FieldPlan& field, WireFormatLite::WireType type, io::CodedInputStream& input, FieldState& state, DecodeMode mode) {
+        field_table_wire2lua(L, index, field, state.hint);
+        int array = lua_gettop(L);
+        if (state.size < 0) {
+            state.stale = static_cast<lua_Integer>(lua_rawlen(L, array));
+            state.size = mode == DECODE_REUSE ? 0 : state.stale;
+        }
+        lua_Integer n = state.size;
+
+        // a reused array keeps its element tables, they are decoded in place and trimmed after
+        if (mode == DECODE_REUSE && field.message) {
+            lua_rawgeti(L, array, n + 1);
+            bool ok;
+            if (lua_type(L, -1) == LUA_TTABLE) {
+                ok = nested_wire2lua(L, lua_gettop(L), field, input, DECODE_REUSE);
+                lua_pop(L, 1);
+            }
+            else {
+                lua_pop(L, 1);
+                ok = (this->*field.decode)(L, field, input);
+                if (ok)
+                    lua_rawseti(L, array, n + 1);
+            }
+            if (!ok)
+                return false;
+            state.size = n + 1;
+            lua_pop(L, 1);
+            return true;
+        }
+
+        if (type == WireFormatLite::WIRETYPE_LENGTH_DELIMITED && field.packed_decode) {
+            uint32      len = 0;
+            const void* data = nullptr;
+            int         size = 0;
+            if (!input.ReadVarint32(&len))
+                return false;
+            if (len > 0) {
+                if (!input.GetDirectBufferPointer(&data, &size) || static_cast<uint32>(size) < len)
+                    return false;
+                if (!(this->*field.packed_decode)(L, array, &n, static_cast<const uint8*>(data), len))
+                    return false;
+                input.Skip(static_cast<int>(len));
+            }
+        }
+        else if (type == WireFormatLite::WIRETYPE_LENGTH_DELIMITED && field.packable) {
+            uint32 len = 0;
+            if (!input.ReadVarint32(&len))
+                return false;
+            io::CodedInputStream::Limit limit = input.PushLimit(static_cast<int>(len));
+            while (input.BytesUntilLimit() > 0) {
+                if (!(this->*field.decode)(L, field, input))
+                    return false;
+                if (lua_isnil(L, -1))
+                    lua_pop(L, 1);
+                else
+                    lua_rawseti(L, array, ++n);
+            }
+            input.PopLimit(limit);
+        }
+        else {
+            if (!(this->*field.decode)(L, field, input))
+                return false;
+            if (lua_isnil(L, -1))
+                lua_pop(L, 1);
+            else
+                lua_rawseti(L, array, ++n);
+        }
+        state.size = n;
+        lua_pop(L, 1);
+        return true;
+    }
+
+    // a run of map entries -> sub[key] = value, entries that follow each other share one lookup of sub
+    bool ScriptProtobuf::map_field_wire2lua(lua_State* L, int index, const FieldPlan& field, io::CodedInputStream& input, FieldState& state, DecodeMode mode) {
+        const FieldPlan& key = field.message->fields[0];
+        const FieldPlan& value = field.message->fields[1];
+        const uint32     entry_tag = WireFormatLite::MakeTag(field.fd->number(), WireFormatLite::WIRETYPE_LENGTH_DELIMITED);
+        const uint32     key_tag = WireFormatLite::MakeTag(key.fd->number(), key.wire_type);
+        const uint32     value_tag = WireFormatLite::MakeTag(value.fd->number(), value.wire_type);
+
+        field_table_wire2lua(L, index, field, state.hint);
+        int map = lua_gettop(L);
+        if (mode == DECODE_REUSE && !state.seen)
+            clear_table2lua(L, map);
+
+        do {
+            if (!map_entry_wire2lua(L, map, field, key_tag, value_tag, input))
+                return false;
+        } while (input.ExpectTag(entry_tag));
+        lua_pop(L, 1);
+        return true;
+    }
+
+    // one entry into the map table at index, the layout serializers write is read without a tag lookup
+    bool ScriptProtobuf::map_entry_wire2lua(lua_State* L, int map, const FieldPlan& field, uint32 key_tag, uint32 value_tag, io::CodedInputStream& input) {
+        const FieldPlan& key = field.message->fields[0];
+        const FieldPlan& value = field.message->fields[1];
+
+        lua_pushnil(L);
+        lua_pushnil(L);
+
+        uint32 len = 0;
+        if (!input.ReadVarint32(&len))
+            return false;
+        io::CodedInputStream::Limit limit = input.PushLimit(static_cast<int>(len));
+        if (input.ExpectTag(key_tag)) {
+            if (!(this->*key.decode)(L, key, input))
+                return false;
+            lua_replace(L, map + 1);
+        }
+        if (input.ExpectTag(value_tag)) {
+            if (!(this->*value.decode)(L, value, input))
+                return false;
+            lua_replace(L, map + 2);
+        }
+        // reordered, repeated or unknown entry fields
+        for (;;) {
+            uint32 tag = input.ReadTag();
+            if (tag == 0)
+                break;
+            const FieldPlan* entry = field.message->find(WireFormatLite::GetTagFieldNumber(tag));
+            if (!entry || WireFormatLite::GetTagWireType(tag) != entry->wire_type) {
+                if (!WireFormatLite::SkipField(&input, tag))
+                    return false;
+                continue;
+            }
+            if (!(this->*entry->decode)(L, *entry, input))
+                return false;
+            lua_replace(L, entry == &key ? map + 1 : map + 2);
+        }
+        if (!input.ConsumedEntireMessage())
+            return false;
+        input.PopLimit(limit);
+
+        if (lua_isnil(L, map + 1)) {
+            default_field2lua(L, key);
+            lua_replace(L, map + 1);
+        }
+        if (lua_isnil(L, map + 2)) {
+            default_field2lua(L, value);
+            lua_replace(L, map + 2);
+        }
+        lua_rawset(L, map);
+        return true;
+    }
+
+    // value of an unset field, same as the reflection getters return
+    void ScriptProtobuf::default_field2lua(lua_State* L, const FieldPlan& field) {
+        const FieldDescriptor* fd = field.fd;
+        if (field.kind != FIELD_SINGLE) {
+            lua_newtable(L);
+            return;
+        }
+
+        switch (fd->cpp_type()) {
+        case FieldDescriptor::CPPTYPE_DOUBLE:
+            lua_pushnumber(L, fd->default_value_double());
+            break;
+        case FieldDescriptor::CPPTYPE_FLOAT:
+            lua_pushnumber(L, fd->default_value_float());
+            break;
+        case FieldDescriptor::CPPTYPE_INT64:
+            lua_pushinteger(L, fd->default_value_int64());
+            break;
+        case FieldDescriptor::CPPTYPE_UINT64:
+            lua_pushuint64(L, fd->default_value_uint64());
+            break;
+        case FieldDescriptor::CPPTYPE_ENUM:
+            if (m_decode.enum_names) {
+                lua_rawgeti(L, LUA_REGISTRYINDEX, field.enumeration->names);
+                lua_rawgeti(L, -1, fd->default_value_enum()->number());
+                lua_remove(L, -2);
+            }
+            else
+                lua_pushinteger(L, fd->default_value_enum()->number());
+            break;
+        case FieldDescriptor::CPPTYPE_INT32:
+            lua_pushinteger(L, fd->default_value_int32());
+            break;
+        case FieldDescriptor::CPPTYPE_UINT32:
+            lua_pushinteger(L, fd->default_value_uint32());
+            break;
+        case FieldDescriptor::CPPTYPE_STRING: {
+            const std::string& value = fd->default_value_string();
+            lua_pushlstring(L, value.data(), value.size());
+            // slice mode gives every bytes field the same type, the default is a view of its own string
+            if (fd->type() == FieldDescriptor::TYPE_BYTES && m_decode.bytes_slice) {
+                const char* data = lua_tostring(L, -1);
+                lua_pushslice(L, data, value.size(), lua_gettop(L));
+                lua_remove(L, -2);
+            }
+            break;
+        }
+        case FieldDescriptor::CPPTYPE_BOOL:
+            lua_pushboolean(L, fd->default_value_bool());
+            break;
+        case FieldDescriptor::CPPTYPE_MESSAGE:
+            default_message2lua(L, *field.message);
+            break;
+        default:
+            PRINTF("unknown type: %d", fd->cpp_type());
+            lua_pushnil(L);
+            break;
+        }
+    }
+
+    // default instance as a table; a self-referential type stops at an empty table that reads its
+    // defaults through the defaults metatable
+    void ScriptProtobuf::default_message2lua(lua_State* L, const MessagePlan& plan) {
+        lua_createtable(L, 0, static_cast<int>(plan.fields.size()));
+        if (std::find(m_default_chain.begin(), m_default_chain.end(), &plan) != m_default_chain.end()) {
+            defaults_metatable2lua(L, plan);
+            lua_setmetatable(L, -2);
+            return;
+        }
+        if (!lua_checkstack(L, LUA_MINSTACK))
+            return;
+
+        // no oneof member is set
+        m_default_chain.push_back(&plan);
+        int index = lua_gettop(L);
+        for (const FieldPlan& field : plan.fields) {
+            if (field.oneof >= 0)
+                continue;
+            lua_rawgeti(L, LUA_REGISTRYINDEX, field.key);
+            default_field2lua(L, field);
+            lua_rawset(L, index);
+        }
+        m_default_chain.pop_back();
+    }
+
+    // __newindex of a detached default: upvalue 1 is the parent, 2 the field key, 3 the metatable of the
+    // message type or false. The first write stores the table in its parent, which attaches a detached parent too
+    static int defaults_attach(lua_State* L) {
+        // a table attached since, from another read of the same field, takes the write
+        lua_pushvalue(L, lua_upvalueindex(2));
+        if (lua_rawget(L, lua_upvalueindex(1)) == LUA_TTABLE && !lua_rawequal(L, -1, 1)) {
+            lua_insert(L, 2);
+            lua_settable(L, 2);
+            return 0;
+        }
+        lua_pop(L, 1);
+
+        lua_rawset(L, 1);
+        if (lua_type(L, lua_upvalueindex(3)) == LUA_TTABLE)
+            lua_pushvalue(L, lua_upvalueindex(3));
+        else
+            lua_pushnil(L);
+        lua_setmetatable(L, 1);
+        lua_pushvalue(L, lua_upvalueindex(2));
+        lua_pushvalue(L, 1);
+        lua_settable(L, lua_upvalueindex(1));
+        return 0;
+    }
+
+    // __index of a table decoded without defaults: upvalue 1 holds the scalar defaults, upvalue 2 the
+    // repeated, map and message fields. Those read as an empty table left out of the record, so a read
+    // does not make a field present; it is stored on its first write
+    static int defaults_index(lua_State* L) {
+        lua_pushvalue(L, 2);
+        if (lua_rawget(L, lua_upvalueindex(1)) != LUA_TNIL)
+            return 1;
+        lua_pop(L, 1);
+        lua_pushvalue(L, 2);
+        if (lua_rawget(L, lua_upvalueindex(2)) == LUA_TNIL)
+            return 1;
+
+        // a message field maps to the metatable of its type, its defaults are read through it meanwhile
+        int meta = lua_gettop(L);
+        lua_newtable(L);
+        lua_createtable(L, 0, 2);
+        if (lua_type(L, meta) == LUA_TTABLE) {
+            lua_getfield(L, meta, "__index");
+            lua_setfield(L, -2, "__index");
+        }
+        else {
+            lua_pushboolean(L, 0);
+            lua_replace(L, meta);
+        }
+        lua_pushvalue(L, 1);
+        lua_pushvalue(L, 2);
+        lua_pushvalue(L, meta);
+        lua_pushcclosure(L, defaults_attach, 3);
+        lua_setfield(L, -2, "__newindex");
+        lua_setmetatable(L, -2);
+        return 1;
+    }
+
+    // metatable shared by the tables of one type decoded with {defaults = "metatable"}, built on first use;
+    // enum defaults are numbers or names as the call decodes enums, one metatable each
+    void ScriptProtobuf::defaults_metatable2lua(lua_State* L, const MessagePlan& plan) {
+        int& defaults = plan.defaults[m_decode.enum_names];
+        if (defaults != LUA_NOREF) {
+            lua_rawgeti(L, LUA_REGISTRYINDEX, defaults);
+            return;
+        }
+        if (!lua_checkstack(L, LUA_MINSTACK)) {
+            lua_pushnil(L);
+            return;
+        }
+
+        // cached before the fields, so self-referential types find it
+        lua_createtable(L, 0, 1);
+        int meta = lua_gettop(L);
+        lua_pushvalue(L, meta);
+        defaults = luaL_ref(L, LUA_REGISTRYINDEX);
+
+        // defaults are shared, bytes stay strings whatever the call decodes them as
+        DecodeOptions saved = m_decode;
+        m_decode.bytes_slice = false;
+        lua_createtable(L, 0, static_cast<int>(plan.fields.size()));
+        lua_newtable(L);
+        for (const FieldPlan& field : plan.fields) {
+            lua_rawgeti(L, LUA_REGISTRYINDEX, field.key);
+            if (field.kind == FIELD_SINGLE && !field.message) {
+                default_field2lua(L, field);
+                lua_rawset(L, meta + 1);
+            }
+            else {
+                if (field.kind == FIELD_SINGLE)
+                    defaults_metatable2lua(L, *field.message);
+                else
+                    lua_pushboolean(L, 1);
+                lua_rawset(L, meta + 2);
+            }
+        }
+        m_decode = saved;
+        lua_pushcclosure(L, defaults_index, 2);
+        lua_setfield(L, meta, "__index");
+    }
+
+    // the table at index has a defaults metatable of plan
+    bool ScriptProtobuf::has_defaults_metatable(lua_State* L, int index, const MessagePlan& plan) {
+        if ((plan.defaults[0] == LUA_NOREF && plan.defaults[1] == LUA_NOREF) || !lua_getmetatable(L, index))
+            return false;
+        lua_rawgeti(L, LUA_REGISTRYINDEX, plan.defaults[0]);
+        lua_rawgeti(L, LUA_REGISTRYINDEX, plan.defaults[1]);
+        bool same = lua_rawequal(L, -1, -3) || lua_rawequal(L, -2, -3);
+        lua_pop(L, 3);
+        return same;
+    }
+
+    // counts repeated and map elements ahead of decoding, so their tables are created at full size
+    void ScriptProtobuf::count_wire2lua(const MessagePlan& plan, io::CodedInputStream& input, FieldState* state) {
+        const void* data = nullptr;
+        int         size = 0;
+        if (!input.GetDirectBufferPointer(&data, &size))
+            return;
+
+        io::CodedInputStream scan(static_cast<const uint8*>(data), size);
+        for (;;) {
+            uint32 tag = scan.ReadTag();
+            if (tag == 0)
+                return;
+
+            const FieldPlan* field = plan.find(WireFormatLite::GetTagFieldNumber(tag));
+            if (field && field->kind != FIELD_SINGLE) {
+                FieldState& s = state[field - plan.fields.data()];
+                if (field->packable && WireFormatLite::GetTagWireType(tag) == WireFormatLite::WIRETYPE_LENGTH_DELIMITED) {
+                    const void* block = nullptr;
+                    int         avail = 0;
+                    uint32      len = 0;
+                    if (!scan.ReadVarint32(&len) || !scan.GetDirectBufferPointer(&block, &avail) || static_cast<uint32>(avail) < len)
+                        return;
+                    switch (field->wire_type) {
+                    case WireFormatLite::WIRETYPE_FIXED32:
+                        s.hint += len / 4;
+                        break;
+                    case WireFormatLite::WIRETYPE_FIXED64:
+                        s.hint += len / 8;
+                        break;
+                    default:
+                        // one varint ends at each byte without the continuation bit
+                        for (uint32 i = 0; i < len; ++i)
+                            s.hint += (static_cast<const uint8*>(block)[i] & 0x80) == 0;
+                        break;
+                    }
+                    scan.Skip(static_cast<int>(len));
+                    continue;
+                }
+                s.hint++;
+            }
+            if (!WireFormatLite::SkipField(&scan, tag))
+                return;
+        }
+    }
+
+    bool ScriptProtobuf::wire2lua(lua_State* L, int index, const MessagePlan& plan, io::CodedInputStream& input, DecodeMode mode) {
+        if (!lua_checkstack(L, LUA_MINSTACK)) {
+            PRINTF("lua stack overflow decoding %s \n", plan.descriptor->full_name().c_str());
+            return false;
+        }
+
+        // decode state by plan slot
+        size_t                        count = plan.fields.size();
+        FieldState                    inline_state[32];
+        std::unique_ptr<FieldState[]> heap_state(count > 32 ? new FieldState[count] : nullptr);
+        FieldState*                   state = heap_state ? heap_state.get() : inline_state;
+        for (size_t i = 0; i < count; ++i) {
+            state[i].seen = false;
+            state[i].hint = 0;
+            state[i].size = -1;
+            state[i].stale = 0;
+        }
+        if (plan.has_repeated)
+            count_wire2lua(plan, input, state);
+
+        uint32 tag = 0;
+        for (;;) {
+            // an END_GROUP tag closes a group, the caller checks it is its own
+            tag = input.ReadTag();
+            if (tag == 0 || WireFormatLite::GetTagWireType(tag) == WireFormatLite::WIRETYPE_END_GROUP)
+                break;
+
+            WireFormatLite::WireType type = WireFormatLite::GetTagWireType(tag);
+            const FieldPlan*         field = plan.find(WireFormatLite::GetTagFieldNumber(tag));
+            if (!field || (type != field->wire_type && !(field->packable && type == WireFormatLite::WIRETYPE_LENGTH_DELIMITED))) {
+                if (!WireFormatLite::SkipField(&input, tag))
+                    return false;
+                continue;
+            }
+
+            size_t slot = field - plan.fields.data();
+            if (field->oneof >= 0)
+                oneof_wire2lua(L, index, plan, slot, state, mode);
+            if (!field_wire2lua(L, index, *field, type, input, state[slot], mode))
+                return false;
+            state[slot].seen = true;
+        }
+        if (tag == 0 && !input.ConsumedEntireMessage())
+            return false;
+
+        if (mode == DECODE_NEW)
+            unset_fields2lua(L, index, plan, state);
+        else if (mode == DECODE_REUSE) {
+            for (size_t i = 0; i < count; ++i)
+                reset_field2lua(L, index, plan.fields[i], state[i]);
+            sweep_message2lua(L, index, plan);
+            if (m_decode.defaults == DEFAULTS_METATABLE) {
+                defaults_metatable2lua(L, plan);
+                lua_setmetatable(L, index);
+            }
+        }
+        if (m_decode.oneof_case)
+            oneof_cases2lua(L, index, plan, state, mode);
+        return true;
+    }
+
+    // a oneof member replaces the one decoded before it, a merge may find one from an earlier pass in the table
+    void ScriptProtobuf::oneof_wire2lua(lua_State* L, int index, const MessagePlan& plan, size_t slot, FieldState* state, DecodeMode mode) {
+        for (int other : plan.oneofs[plan.fields[slot].oneof].slots) {
+            if (other == static_cast<int>(slot) || (!state[other].seen && mode != DECODE_MERGE))
+                continue;
+            state[other].seen = false;
+            lua_rawgeti(L, LUA_REGISTRYINDEX, plan.fields[other].key);
+            lua_pushnil(L);
+            lua_rawset(L, index);
+        }
+    }
+
+    // "<oneof>_case" = name of the member on the wire; a merge without one keeps the case it had
+    void ScriptProtobuf::oneof_cases2lua(lua_State* L, int index, const MessagePlan& plan, const FieldState* state, DecodeMode mode) {
+        for (const OneofPlan& oneof : plan.oneofs) {
+            int active = -1;
+            for (int slot : oneof.slots) {
+                if (state[slot].seen) {
+                    active = slot;
+                    break;
+                }
+            }
+            if (active < 0 && mode != DECODE_REUSE)
+                continue;
+            lua_rawgeti(L, LUA_REGISTRYINDEX, oneof.key);
+            if (active < 0)
+                lua_pushnil(L);
+            else
+                lua_rawgeti(L, LUA_REGISTRYINDEX, plan.fields[active].key);
+            lua_rawset(L, index);
+        }
+    }
+
+    // fields missing from the wire get their defaults, like protobuf2lua, unless the options leave them out
+    void ScriptProtobuf::unset_fields2lua(lua_State* L, int index, const MessagePlan& plan, const FieldState* state) {
+        if (m_decode.defaults == DEFAULTS_METATABLE) {
+            defaults_metatable2lua(L, plan);
+            lua_setmetatable(L, index);
+        }
+        if (m_decode.defaults != DEFAULTS_FILL)
+            return;
+        // only the oneof member on the wire is set
+        for (size_t i = 0; i < plan.fields.size(); ++i) {
+            if (state[i].seen || plan.fields[i].oneof >= 0)
+                continue;
+            lua_rawgeti(L, LUA_REGISTRYINDEX, plan.fields[i].key);
+            default_field2lua(L, plan.fields[i]);
+            lua_rawset(L, index);
+        }
+    }
+
+    // hash size of a new decoded table, only a filled one is known to get every field
+    int ScriptProtobuf::table_size2lua(const MessagePlan& plan) const {
+        return m_decode.defaults == DEFAULTS_FILL ? static_cast<int>(plan.fields.size()) : 0;
+    }
+
+    // wire2lua over the fields node selects, the others are skipped by their length without creating lua values
+    bool ScriptProtobuf::project_wire2lua(lua_State* L, int index, const ProjectionNode& node, io::CodedInputStream& input, DecodeMode mode) {
+        if (!lua_checkstack(L, LUA_MINSTACK)) {
+            PRINTF("lua stack overflow decoding %s \n", node.plan->descriptor->full_name().c_str());
+            return false;
+        }
+
+        const MessagePlan&            plan = *node.plan;
+        size_t                        count = node.slots.size();
+        FieldState                    inline_state[32];
+        std::unique_ptr<FieldState[]> heap_state(count > 32 ? new FieldState[count] : nullptr);
+        FieldState*                   state = heap_state ? heap_state.get() : inline_state;
+        for (size_t i = 0; i < count; ++i) {
+            state[i].seen = false;
+            state[i].hint = 0;
+            state[i].size = -1;
+            state[i].stale = 0;
+        }
+        if (plan.has_repeated && count)
+            count_wire2lua(plan, input, state);
+
+        uint32 tag = 0;
+        for (;;) {
+            // an END_GROUP tag closes a group, the caller checks it is its own
+            tag = input.ReadTag();
+            if (tag == 0 || WireFormatLite::GetTagWireType(tag) == WireFormatLite::WIRETYPE_END_GROUP)
+                break;
+
+            WireFormatLite::WireType type = WireFormatLite::GetTagWireType(tag);
+            const FieldPlan*         field = count ? plan.find(WireFormatLite::GetTagFieldNumber(tag)) : nullptr;
+            const ProjectionNode*    sub = field ? node.slots[field - plan.fields.data()].get() : nullptr;
+            if (!sub || (type != field->wire_type && !(field->packable && type == WireFormatLite::WIRETYPE_LENGTH_DELIMITED))) {
+                if (!WireFormatLite::SkipField(&input, tag))
+                    return false;
+                continue;
+            }
+
+            size_t slot = field - plan.fields.data();
+            if (field->oneof >= 0)
+                oneof_wire2lua(L, index, plan, slot, state, mode);
+            bool   ok = sub->whole ? field_wire2lua(L, index, *field, type, input, state[slot], mode)
+                                   : project_field_wire2lua(L, index, *field, *sub, input, state[slot]);
+            if (!ok)
+                return false;
+            state[slot].seen = true;
+        }
+        if (tag == 0 && !input.ConsumedEntireMessage())
+            return false;
+
+        if (mode == DECODE_NEW && m_decode.defaults == DEFAULTS_METATABLE) {
+            defaults_metatable2lua(L, plan);
+            lua_setmetatable(L, index);
+        }
+        if (mode == DECODE_NEW && m_decode.defaults == DEFAULTS_FILL) {
+            for (size_t i = 0; i < count; ++i) {
+                if (state[i].seen || !node.slots[i] || plan.fields[i].oneof >= 0)
+                    continue;
+                lua_rawgeti(L, LUA_REGISTRYINDEX, plan.fields[i].key);
+                project_default2lua(L, plan.fields[i], *node.slots[i]);
+                lua_rawset(L, index);
+            }
+        }
+        if (m_decode.oneof_case && count)
+            oneof_cases2lua(L, index, plan, state, mode);
+        return true;
+    }
+
+    // one occurrence of a message field some paths go into; a singular one seen twice is merged
+    bool ScriptProtobuf::project_field_wire2lua(lua_State* L, int index, const FieldPlan& field, const ProjectionNode& node, io::CodedInputStream& input, FieldState& state) {
+        int top = lua_gettop(L);
+        if (field.kind == FIELD_SINGLE) {
+            lua_rawgeti(L, LUA_REGISTRYINDEX, field.key);
+            lua_pushvalue(L, -1);
+            lua_rawget(L, index);
+            if (!state.seen || lua_type(L, -1) != LUA_TTABLE) {
+                lua_pop(L, 1);
+                lua_newtable(L);
+                lua_pushvalue(L, -2);
+                lua_pushvalue(L, -2);
+                lua_rawset(L, index);
+            }
+        }
+        else {
+            field_table_wire2lua(L, index, field, state.hint);
+            if (state.size < 0)
+                state.size = static_cast<lua_Integer>(lua_rawlen(L, -1));
+            lua_newtable(L);
+            lua_pushvalue(L, -1);
+            lua_rawseti(L, -3, ++state.size);
+        }
+
+        DecodeMode mode = field.kind == FIELD_SINGLE && state.seen ? DECODE_MERGE : DECODE_NEW;
+        if (field.fd->type() == FieldDescriptor::TYPE_GROUP) {
+            if (!input.IncrementRecursionDepth())
+                return false;
+            if (!project_wire2lua(L, lua_gettop(L), node, input, mode))
+                return false;
+            if (!input.LastTagWas(WireFormatLite::MakeTag(field.fd->number(), WireFormatLite::WIRETYPE_END_GROUP)))
+                return false;
+            input.DecrementRecursionDepth();
+            lua_settop(L, top);
+            return true;
+        }
+
+        uint32 len = 0;
+        if (!input.ReadVarint32(&len))
+            return false;
+        if (!input.IncrementRecursionDepth())
+            return false;
+        io::CodedInputStream::Limit limit = input.PushLimit(static_cast<int>(len));
+        if (!project_wire2lua(L, lua_gettop(L), node, input, mode))
+            return false;
+        if (!input.ConsumedEntireMessage())
+            return false;
+        input.PopLimit(limit);
+        input.DecrementRecursionDepth();
+        lua_settop(L, top);
+        return true;
+    }
+
+    // default of a selected field missing from the wire, a partly selected message gets its selected fields only
+    void ScriptProtobuf::project_default2lua(lua_State* L, const FieldPlan& field, const ProjectionNode& node) {
+        if (node.whole || field.kind != FIELD_SINGLE) {
+            default_field2lua(L, field);
+            return;
+        }
+        lua_newtable(L);
+        int index = lua_gettop(L);
+        for (size_t i = 0; i < node.slots.size(); ++i) {
+            if (!node.slots[i] || node.plan->fields[i].oneof >= 0)
+                continue;
+            lua_rawgeti(L, LUA_REGISTRYINDEX, node.plan->fields[i].key);
+            project_default2lua(L, node.plan->fields[i], *node.slots[i]);
+            lua_rawset(L, index);
+        }
+    }
+
+    // after a DECODE_REUSE pass: trims a decoded array, empties an unseen field's table or sets its default
+    void ScriptProtobuf::reset_field2lua(lua_State* L, int index, const FieldPlan& field, const FieldState& state) {
+        if (state.seen && field.kind == FIELD_SINGLE)
+            return;
+        if (!state.seen && (m_decode.defaults != DEFAULTS_FILL || field.oneof >= 0)) {
+            lua_rawgeti(L, LUA_REGISTRYINDEX, field.key);
+            lua_pushnil(L);
+            lua_rawset(L, index);
+            return;
+        }
+
+        lua_rawgeti(L, LUA_REGISTRYINDEX, field.key);
+        lua_rawget(L, index);
+        if (lua_type(L, -1) == LUA_TTABLE) {
+            int sub = lua_gettop(L);
+            if (field.kind == FIELD_MAP) {
+                if (!state.seen)
+                    clear_table2lua(L, sub);
+                lua_pop(L, 1);
+                return;
+            }
+            if (field.kind != FIELD_SINGLE) {
+                if (state.seen)
+                    trim_array2lua(L, sub, state.size, state.stale);
+                else
+                    clear_table2lua(L, sub);
+                lua_pop(L, 1);
+                return;
+            }
+            if (field.message) {
+                reset_message2lua(L, sub, *field.message);
+                lua_pop(L, 1);
+                return;
+            }
+        }
+        lua_pop(L, 1);
+
+        lua_rawgeti(L, LUA_REGISTRYINDEX, field.key);
+        default_field2lua(L, field);
+        lua_rawset(L, index);
+    }
+
+    // default instance into an existing table, same shape as default_message2lua
+    void ScriptProtobuf::reset_message2lua(lua_State* L, int index, const MessagePlan& plan) {
+        if (std::find(m_default_chain.begin(), m_default_chain.end(), &plan) != m_default_chain.end() ||
+            !lua_checkstack(L, LUA_MINSTACK)) {
+            clear_table2lua(L, index);
+            return;
+        }
+
+        FieldState unseen = {false, 0, -1, 0};
+        m_default_chain.push_back(&plan);
+        for (const FieldPlan& field : plan.fields)
+            reset_field2lua(L, index, field, unseen);
+        sweep_message2lua(L, index, plan);
+        m_default_chain.pop_back();
+    }
+
+    // removes keys that are not fields of plan
+    void ScriptProtobuf::sweep_message2lua(lua_State* L, int index, const MessagePlan& plan) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, plan.names);
+        int names = lua_gettop(L);
+        lua_pushnil(L);
+        while (lua_next(L, index)) {
+            lua_pop(L, 1);
+            if (lua_type(L, -1) == LUA_TSTRING) {
+                lua_pushvalue(L, -1);
+                if (lua_rawget(L, names) != LUA_TNIL) {
+                    lua_pop(L, 1);
+                    continue;
+                }
+                lua_pop(L, 1);
+            }
+            lua_pushvalue(L, -1);
+            lua_pushnil(L);
+            lua_rawset(L, index);
+        }
+        lua_pop(L, 1);
+    }
+
+    void ScriptProtobuf::trim_array2lua(lua_State* L, int index, lua_Integer size, lua_Integer stale) {
+        for (lua_Integer i = stale; i > size; --i) {
+            lua_pushnil(L);
+            lua_rawseti(L, index, i);
+        }
+    }
+
+    // assigning nil during lua_next is allowed, the table keeps its allocated parts
+    void ScriptProtobuf::clear_table2lua(lua_State* L, int index) {
+        lua_pushnil(L);
+        while (lua_next(L, index)) {
+            lua_pop(L, 1);
+            lua_pushvalue(L, -1);
+            lua_pushnil(L);
+            lua_rawset(L, index);
+        }
+    }
+
+    static void register_lazy(lua_State* L) {
+        luaL_newmetatable(L, kLazyMetatable);
+        lua_pushcfunction(L, (ScriptProtobuf::Guard<ScriptProtobuf::LazyOwner, ScriptProtobuf::LazyIndex>));
+        lua_setfield(L, -2, "__index");
+        lua_pushcfunction(L, ScriptProtobuf::LazyNewIndex);
+        lua_setfield(L, -2, "__newindex");
+        lua_pushcfunction(L, ScriptProtobuf::LazyPairs);
+        lua_setfield(L, -2, "__pairs");
+        lua_pushcfunction(L, ScriptProtobuf::LazyLen);
+        lua_setfield(L, -2, "__len");
+        lua_pop(L, 1);
+    }
+
+#ifdef PRIVATE_REQUIRE
+    // register to a table
+    static sol::table require_api(sol::this_state L) {
+        sol::state_view lua(L);
+
+        sol::table module = lua.create_table();
+        register_slice(L);
+        register_lazy(L);
+        module.new_usertype<ScriptProtobufBuffer>("pb_buffer",
+            sol::constructors<ScriptProtobufBuffer()>(),
+            "size",
+            &ScriptProtobufBuffer::Size,
+            "tostring",
+            &ScriptProtobufBuffer::ToString,
+            "consume",
+            &ScriptProtobufBuffer::Consume,
+            "clear",
+            &ScriptProtobufBuffer::Clear);
+
+        module.new_usertype<ScriptProtobufArena>("pb_arena",
+            "new",
+            sol::no_constructor,
+            "reset",
+            &ScriptProtobufArena::Reset,
+            "close",
+            &ScriptProtobufArena::Close,
+            "space_used",
+            &ScriptProtobufArena::SpaceUsed);
+
+        module.new_usertype<ScriptProtobufProjection>("pb_projection",
+            "new",
+            sol::no_constructor,
+            "name",
+            &ScriptProtobufProjection::Name);
+
+        module.new_usertype<ScriptProtobufType>("pb_type",
+            "new",
+            sol::no_constructor,
+            "encode",
+            &ScriptProtobuf::Guard<ScriptProtobufType::Owner, &ScriptProtobufType::Encode>,
+            "encode_to",
+            &ScriptProtobufType::EncodeTo,
+            "encode_many",
+            &ScriptProtobuf::Guard<ScriptProtobufType::Owner, &ScriptProtobufType::EncodeMany>,
+            "decode_many",
+            &ScriptProtobuf::Guard<ScriptProtobufType::Owner, &ScriptProtobufType::DecodeMany>,
+            "encode_reflect",
+            &ScriptProtobuf::Guard<ScriptProtobufType::Owner, &ScriptProtobufType::EncodeReflect>,
+            "decode",
+            &ScriptProtobuf::Guard<ScriptProtobufType::Owner, &ScriptProtobufType::Decode>,
+            "decode_into",
+            &ScriptProtobuf::Guard<ScriptProtobufType::Owner, &ScriptProtobufType::DecodeInto>,
+            "decode_lazy",
+            &ScriptProtobuf::Guard<ScriptProtobufType::Owner, &ScriptProtobufType::DecodeLazy>,
+            "decode_reflect",
+            &ScriptProtobuf::Guard<ScriptProtobufType::Owner, &ScriptProtobufType::DecodeReflect>,
+            "name",
+            &ScriptProtobufType::Name);
+
+        module.new_usertype<ScriptProtobuf>("pb",
+            sol::constructors<ScriptProtobuf(sol::this_state, const std::string&)>(),
+            "encode",
+            &ScriptProtobuf::Guard<ScriptProtobuf::Owner, &ScriptProtobuf::Encode>,
+            "encode_to",
+            &ScriptProtobuf::EncodeTo,
+            "encode_many",
+            &ScriptProtobuf::Guard<ScriptProtobuf::Owner, &ScriptProtobuf::EncodeMany>,
+            "decode_many",
+            &ScriptProtobuf::Guard<ScriptProtobuf::Owner, &ScriptProtobuf::DecodeMany>,
+            "encode_reflect",
+            &ScriptProtobuf::Guard<ScriptProtobuf::Owner, &ScriptProtobuf::EncodeReflect>,
+            "decode",
+            &ScriptProtobuf::Guard<ScriptProtobuf::Owner, &ScriptProtobuf::Decode>,
+            "decode_into",
+            &ScriptProtobuf::Guard<ScriptProtobuf::Owner, &ScriptProtobuf::DecodeInto>,
+            "decode_lazy",
+            &ScriptProtobuf::Guard<ScriptProtobuf::Owner, &ScriptProtobuf::DecodeLazy>,
+            "decode_reflect",
+            &ScriptProtobuf::Guard<ScriptProtobuf::Owner, &ScriptProtobuf::DecodeReflect>,
+            "get_enum",
+            &ScriptProtobuf::GetEnum,
+            "get_message",
+            &ScriptProtobuf::Guard<ScriptProtobuf::Owner, &ScriptProtobuf::GetStruct>,
+            "type",
+            &ScriptProtobuf::Type,
+            "arena",
+            &ScriptProtobuf::OpenArena,
+            "projection",
+            &ScriptProtobuf::Projection);
+
+        return module;
+    }
+}
+// lua require
+LUA_API int luaopen_luapb(lua_State* L) {
+    return sol::stack::call_lua(L, 1, lua_module::require_api);
+}
+
+// c++ register
+LUA_API int require_luapb(lua_State* L) {
+    luaL_requiref(L, "luapb", luaopen_luapb, 0);
+    PRINTF("lua module: require luapb\n");
+    return 1;
+}
+
+#else
+    //register to public
+    static int require_api(sol::state_view lua) {
+        register_slice(lua.lua_state());
+        register_lazy(lua.lua_state());
+        lua.new_usertype<ScriptProtobufBuffer>("pb_buffer",
+            sol::constructors<ScriptProtobufBuffer()>(),
+            "size",
+            &ScriptProtobufBuffer::Size,
+            "tostring",
+            &ScriptProtobufBuffer::ToString,
+            "consume",
+            &ScriptProtobufBuffer::Consume,
+            "clear",
+            &ScriptProtobufBuffer::Clear);
+
+        lua.new_usertype<ScriptProtobufArena>("pb_arena",
+            "new",
+            sol::no_constructor,
+            "reset",
+            &ScriptProtobufArena::Reset,
+            "close",
+            &ScriptProtobufArena::Close,
+            "space_used",
+            &ScriptProtobufArena::SpaceUsed);
+
+        lua.new_usertype<ScriptProtobufProjection>("pb_projection",
+            "new",
+            sol::no_constructor,
+            "name",
+            &ScriptProtobufProjection::Name);
+
+        lua.new_usertype<ScriptProtobufType>("pb_type",
+            "new",
+            sol::no_constructor,
+            "encode",
+            &ScriptProtobuf::Guard<ScriptProtobufType::Owner, &ScriptProtobufType::Encode>,
+            "encode_to",
+            &ScriptProtobufType::EncodeTo,
+            "encode_many",
+            &ScriptProtobuf::Guard<ScriptProtobufType::Owner, &ScriptProtobufType::EncodeMany>,
+            "decode_many",
+            &ScriptProtobuf::Guard<ScriptProtobufType::Owner, &ScriptProtobufType::DecodeMany>,
+            "encode_reflect",
+            &ScriptProtobuf::Guard<ScriptProtobufType::Owner, &ScriptProtobufType::EncodeReflect>,
+            "decode",
+            &ScriptProtobuf::Guard<ScriptProtobufType::Owner, &ScriptProtobufType::Decode>,
+            "decode_into",
+            &ScriptProtobuf::Guard<ScriptProtobufType::Owner, &ScriptProtobufType::DecodeInto>,
+            "decode_lazy",
+            &ScriptProtobuf::Guard<ScriptProtobufType::Owner, &ScriptProtobufType::DecodeLazy>,
+            "decode_reflect",
+            &ScriptProtobuf::Guard<ScriptProtobufType::Owner, &ScriptProtobufType::DecodeReflect>,
+            "name",
+            &ScriptProtobufType::Name);
+
         lua.new_usertype<ScriptProtobuf>("pb",
             sol::constructors<ScriptProtobuf(sol::this_state, const std::string&)>(),
             "encode",
-            &ScriptProtobuf::Encode,
+            &ScriptProtobuf::Guard<ScriptProtobuf::Owner, &ScriptProtobuf::Encode>,
+            "encode_to",
+            &ScriptProtobuf::EncodeTo,
+            "encode_many",
+            &ScriptProtobuf::Guard<ScriptProtobuf::Owner, &ScriptProtobuf::EncodeMany>,
+            "decode_many",
+            &ScriptProtobuf::Guard<ScriptProtobuf::Owner, &ScriptProtobuf::DecodeMany>,
+            "encode_reflect",
+            &ScriptProtobuf::Guard<ScriptProtobuf::Owner, &ScriptProtobuf::EncodeReflect>,
             "decode",
-            &ScriptProtobuf::Decode,
+            &ScriptProtobuf::Guard<ScriptProtobuf::Owner, &ScriptProtobuf::Decode>,
+            "decode_into",
+            &ScriptProtobuf::Guard<ScriptProtobuf::Owner, &ScriptProtobuf::DecodeInto>,
+            "decode_lazy",
+            &ScriptProtobuf::Guard<ScriptProtobuf::Owner, &ScriptProtobuf::DecodeLazy>,
+            "decode_reflect",
+            &ScriptProtobuf::Guard<ScriptProtobuf::Owner, &ScriptProtobuf::DecodeReflect>,
             "get_enum",
             &ScriptProtobuf::GetEnum,
             "get_message",
-            &ScriptProtobuf::GetStruct);
+            &ScriptProtobuf::Guard<ScriptProtobuf::Owner, &ScriptProtobuf::GetStruct>,
+            "type",
+            &ScriptProtobuf::Type,
+            "arena",
+            &ScriptProtobuf::OpenArena,
+            "projection",
+            &ScriptProtobuf::Projection);
 
         return 1;
     }